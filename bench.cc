@@ -0,0 +1,482 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Microbenchmarks for the performance-critical parts of the backup code.
+ * This is not installed; it is built with "make bench" and run from the top
+ * of the source tree (it needs schema.sql to set up a scratch local
+ * database).  Usage: cumulus-bench [SCHEMA-FILE [NUM-BLOCKS]].
+ *
+ * Output is line-oriented and meant to be easy to parse: each line gives the
+ * name of a benchmark, the measured value, and the unit, separated by tabs.
+ * Data-dependent benchmarks run on synthetic data at several levels of
+ * entropy (see fill_data), named by a suffix on the benchmark name. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chunker.h"
+#include "exclude.h"
+#include "hash.h"
+#include "localdb.h"
+#include "ref.h"
+#include "store.h"
+#include "util.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+/* Size recorded for each block stored in the local database benchmarks. */
+static const int BENCH_BLOCK_SIZE = 1024 * 1024;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const string &name, double value, const char *unit)
+{
+    printf("%s\t%.1f\t%s\n", name.c_str(), value, unit);
+    fflush(stdout);
+}
+
+/* Time a loop of count operations, started at the given time. */
+static void report_rate(const string &name, double start, int count)
+{
+    double elapsed = now() - start;
+    report(name, count / elapsed, "ops/s");
+}
+
+/* Create an empty local database at path using the given schema file. */
+static void create_localdb(const string &path, const string &schema_file)
+{
+    std::ifstream in(schema_file.c_str());
+    if (!in)
+        fatal("Unable to read " + schema_file);
+    std::stringstream schema;
+    schema << in.rdbuf();
+
+    sqlite3 *db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+        fatal("Unable to create " + path);
+    char *err = NULL;
+    if (sqlite3_exec(db, schema.str().c_str(), NULL, NULL, &err)
+            != SQLITE_OK) {
+        fprintf(stderr, "%s\n", err);
+        fatal("Unable to initialize local database");
+    }
+    sqlite3_close(db);
+}
+
+/* The per-block local database operations performed while writing a
+ * snapshot: storing new blocks, looking up blocks by checksum (both hits and
+ * misses), and recording the blocks used. */
+static void bench_localdb(const string &schema_file, int count)
+{
+    char dbpath[] = "/tmp/cumulus-bench.XXXXXX";
+    int fd = mkstemp(dbpath);
+    if (fd < 0)
+        fatal("Unable to create temporary database");
+    close(fd);
+    create_localdb(dbpath, schema_file);
+
+    vector<ObjectReference> refs;
+    vector<string> checksums, missing;
+    string segment;
+    for (int i = 0; i < count; i++) {
+        if (i % 1024 == 0)
+            segment = generate_uuid();
+        ObjectReference ref(segment, i % 1024);
+        Hash *hash = Hash::New();
+        hash->update(&i, sizeof(i));
+        checksums.push_back(hash->digest_str());
+        delete hash;
+        ref.set_checksum(checksums.back());
+        ref.set_range(0, BENCH_BLOCK_SIZE, true);
+        refs.push_back(ref);
+
+        hash = Hash::New();
+        int j = -i - 1;
+        hash->update(&j, sizeof(j));
+        missing.push_back(hash->digest_str());
+        delete hash;
+    }
+
+    LocalDb db;
+    db.Open(dbpath, "bench", "bench");
+
+    double start = now();
+    for (int i = 0; i < count; i++)
+        db.StoreObject(refs[i], 0.0);
+    report_rate("localdb.store_object", start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++)
+        db.FindObject(checksums[i], BENCH_BLOCK_SIZE);
+    report_rate("localdb.find_object_hit", start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++)
+        db.FindObject(missing[i], BENCH_BLOCK_SIZE);
+    report_rate("localdb.find_object_miss", start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        double age;
+        int group;
+        db.IsOldObject(checksums[i], BENCH_BLOCK_SIZE, &age, &group);
+    }
+    report_rate("localdb.is_old_object", start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++)
+        db.IsAvailable(refs[i]);
+    report_rate("localdb.is_available", start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++)
+        db.UseObject(refs[i]);
+    report_rate("localdb.use_object", start, count);
+
+    start = now();
+    db.Close();
+    report("localdb.close", (now() - start) * 1000, "ms");
+
+    struct stat stat_buf;
+    if (stat(dbpath, &stat_buf) == 0)
+        report("localdb.bytes_per_block", (double)stat_buf.st_size / count,
+               "bytes");
+
+    // Lookups of new data, answered by the checksum filter.
+    start = now();
+    db.Open(dbpath, "bench-filter", "bench", 16 << 20);
+    report("localdb.filter_load", (now() - start) * 1000, "ms");
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        double age;
+        int group;
+        if (db.FindObject(missing[i], BENCH_BLOCK_SIZE).is_null())
+            db.IsOldObject(missing[i], BENCH_BLOCK_SIZE, &age, &group);
+    }
+    report_rate("localdb.lookup_new_filtered", start, count);
+    db.Close();
+
+    unlink(dbpath);
+}
+
+/* Synthetic data: each byte has the given number of bits of (reproducible)
+ * pseudo-random data, so "zero" is all zeroes, "low" is like text in its
+ * compressibility, and "random" is incompressible. */
+static const struct {
+    const char *name;
+    int bits;
+} entropy_levels[] = {
+    {"zero", 0},
+    {"low", 4},
+    {"random", 8},
+    {NULL, 0},
+};
+
+static void fill_data(char *buf, size_t len, int bits)
+{
+    uint64_t state = 1;
+    int mask = (1 << bits) - 1;
+    for (size_t i = 0; i < len; i++) {
+        state = state * UINT64_C(6364136223846793005) + 1;
+        buf[i] = (state >> 56) & mask;
+    }
+}
+
+/* Sub-file chunking: throughput and average chunk size for each algorithm,
+ * and how well chunk boundaries survive inserting a byte at the start of each
+ * block (the fraction of chunks in the modified data also found in the
+ * original). */
+static void bench_chunkers()
+{
+    const size_t BLOCK_SIZE = 1024 * 1024;
+    const int NUM_BLOCKS = 32;
+
+    chunker_init();
+
+    vector<char> data(BLOCK_SIZE * NUM_BLOCKS + 1);
+
+    const char *algorithms[] = {"lbfs", "fastcdc", NULL};
+    for (int a = 0; algorithms[a] != NULL; a++) {
+        Chunker *chunker = Chunker::New(algorithms[a]);
+        string name = "chunk." + chunker->name();
+        vector<size_t> breaks(chunker->max_num_breaks(BLOCK_SIZE));
+
+        double start;
+        long chunks = 0;
+        for (int e = 0; entropy_levels[e].name != NULL; e++) {
+            fill_data(&data[0], data.size(), entropy_levels[e].bits);
+            start = now();
+            chunks = 0;
+            for (int i = 0; i < NUM_BLOCKS; i++)
+                chunks += chunker->compute_breaks(&data[i * BLOCK_SIZE],
+                                                  BLOCK_SIZE, &breaks[0]);
+            report(name + "." + entropy_levels[e].name,
+                   BLOCK_SIZE * NUM_BLOCKS / (now() - start) / 1e6, "MB/s");
+        }
+
+        // The remaining tests use the random data left from the last pass.
+        report(name + ".average_size",
+               (double)BLOCK_SIZE * NUM_BLOCKS / chunks, "bytes");
+
+        // Chunk boundaries, as absolute offsets of chunk ends, with and
+        // without the data shifted by one byte.
+        std::set<size_t> original;
+        int n = chunker->compute_breaks(&data[1], BLOCK_SIZE, &breaks[0]);
+        for (int i = 0; i < n; i++)
+            original.insert(breaks[i] + 1);
+        n = chunker->compute_breaks(&data[0], BLOCK_SIZE, &breaks[0]);
+        int found = 0;
+        size_t prev = 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0 && original.count(prev) && original.count(breaks[i]))
+                found++;
+            prev = breaks[i];
+        }
+        report(name + ".shift_reuse", 100.0 * found / n, "%");
+
+        // The incremental interface, fed in small pieces, must agree with
+        // chunking the data all at once.
+        vector<size_t> streamed;
+        const size_t PIECE_SIZE = 4099;
+        start = now();
+        for (size_t i = 0; i < data.size(); i += PIECE_SIZE) {
+            chunker->update(&data[i], std::min(PIECE_SIZE, data.size() - i),
+                            &streamed);
+        }
+        chunker->finish(&streamed);
+        report(name + ".stream", data.size() / (now() - start) / 1e6,
+               "MB/s");
+
+        vector<size_t> whole(chunker->max_num_breaks(data.size()));
+        whole.resize(chunker->compute_breaks(&data[0], data.size(),
+                                             &whole[0]));
+        if (streamed != whole)
+            fatal("Incremental chunking does not match for " + name);
+
+        delete chunker;
+    }
+}
+
+/* Each hash algorithm: throughput over large buffers, and the rate for
+ * messages about the size of a subfile chunk.  The portable implementations
+ * are measured as well as any using processor extensions, and both must
+ * give the same results. */
+static void bench_hashes()
+{
+    const size_t BUFFER_SIZE = 1024 * 1024;
+    const int NUM_BUFFERS = 64;
+    const size_t SMALL_SIZE = 4096;
+    const int NUM_SMALL = 16384;
+
+    vector<char> data(BUFFER_SIZE);
+    fill_data(&data[0], data.size(), 8);
+
+    map<string, string> portable_digests;
+    for (int accelerated = 0; accelerated <= 1; accelerated++) {
+        hash_init(accelerated);
+
+        vector<string> names = Hash::names();
+        for (size_t h = 0; h < names.size(); h++) {
+            string name = "hash." + names[h];
+            if (!accelerated)
+                name += ".portable";
+
+            double start = now();
+            Hash *hash = Hash::New(names[h]);
+            for (int i = 0; i < NUM_BUFFERS; i++) {
+                // Vary the alignment and split the buffer at odd offsets, to
+                // exercise the partial block handling.
+                hash->update(&data[i], 100);
+                hash->update(&data[i + 100], BUFFER_SIZE - i - 100);
+            }
+            string digest = hash->digest_str();
+            delete hash;
+            report(name, BUFFER_SIZE * NUM_BUFFERS / (now() - start) / 1e6,
+                   "MB/s");
+
+            start = now();
+            for (int i = 0; i < NUM_SMALL; i++) {
+                hash = Hash::New(names[h]);
+                hash->update(&data[(i * SMALL_SIZE) % BUFFER_SIZE + i % 64],
+                             SMALL_SIZE - i % 64);
+                digest.append((const char *)hash->digest(),
+                              hash->digest_size());
+                delete hash;
+            }
+            report_rate(name + ".4k", start, NUM_SMALL);
+
+            if (!accelerated)
+                portable_digests[names[h]] = digest;
+            else if (portable_digests[names[h]] != digest)
+                fatal("Hash " + names[h] + " results differ from portable");
+        }
+    }
+}
+
+/* Formatting and parsing object references, as done for every block written
+ * to the metadata log and read back from the statcache. */
+static void bench_refs()
+{
+    const int COUNT = 100000;
+
+    vector<ObjectReference> refs;
+    string segment;
+    for (int i = 0; i < COUNT; i++) {
+        if (i % 1024 == 0)
+            segment = generate_uuid();
+        ObjectReference ref(segment, i % 1024);
+        Hash *hash = Hash::New();
+        hash->update(&i, sizeof(i));
+        ref.set_checksum(hash->digest_str());
+        delete hash;
+        if (i % 2)
+            ref.set_range(0, i, true);
+        else
+            ref.set_range(i, 4096);
+        refs.push_back(ref);
+    }
+
+    vector<string> strings(COUNT);
+    double start = now();
+    for (int i = 0; i < COUNT; i++)
+        strings[i] = refs[i].to_string();
+    report_rate("ref.to_string", start, COUNT);
+
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        if (ObjectReference::parse(strings[i]).is_null())
+            fatal("Unable to parse " + strings[i]);
+    }
+    report_rate("ref.parse", start, COUNT);
+}
+
+/* Include/exclude pattern matching, which is done for every file scanned
+ * against every rule in effect. */
+static void bench_patterns()
+{
+    const int ROUNDS = 2000;
+
+    const char *patterns[] = {
+        "*.o", "/home/", "**/.git/", "/var/cache/**", "/home/*/tmp/",
+        "*~", "/usr/share/doc/**/*.gz", "core", NULL,
+    };
+    const char *paths[] = {
+        "home/", "home/user/", "home/user/src/cumulus/store.cc",
+        "home/user/src/cumulus/store.o", "home/user/src/cumulus/.git/",
+        "home/user/tmp/", "var/cache/apt/archives/foo.deb",
+        "usr/share/doc/cumulus/NEWS.gz", "etc/passwd", "README~", NULL,
+    };
+
+    vector<FilePattern *> compiled;
+    for (int i = 0; patterns[i] != NULL; i++)
+        compiled.push_back(new FilePattern(patterns[i], ""));
+
+    int count = 0, matches = 0;
+    double start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int p = 0; paths[p] != NULL; p++) {
+            string path = paths[p];
+            for (size_t i = 0; i < compiled.size(); i++) {
+                if (compiled[i]->matches(path))
+                    matches++;
+                count++;
+            }
+        }
+    }
+    report_rate("exclude.matches", start, count);
+
+    for (size_t i = 0; i < compiled.size(); i++)
+        compiled[i]->unref();
+}
+
+/* Building segments in memory, for small objects (such as metadata log
+ * blocks) and for full-size data blocks.  Segments are finished at about the
+ * size the segment store uses. */
+static void bench_tarfile()
+{
+    const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+    const size_t TOTAL_SIZE = 256 * 1024 * 1024;
+    const size_t object_sizes[] = {4096, 1024 * 1024, 0};
+
+    vector<char> data(1024 * 1024);
+    fill_data(&data[0], data.size(), 8);
+
+    for (int s = 0; object_sizes[s] != 0; s++) {
+        size_t size = object_sizes[s];
+        int count = TOTAL_SIZE / size;
+        string segment = generate_uuid();
+        string contents;
+
+        double start = now();
+        Tarfile *tar = new Tarfile(segment);
+        for (int i = 0; i < count; i++) {
+            tar->write_object(i, &data[0], size);
+            if (tar->size() >= SEGMENT_SIZE) {
+                tar->finish(&contents);
+                delete tar;
+                tar = new Tarfile(segment);
+            }
+        }
+        tar->finish(&contents);
+        delete tar;
+        double elapsed = now() - start;
+
+        string name = string_printf("tar.write_object.%zd", size);
+        report(name, count / elapsed, "ops/s");
+        report(name + ".throughput", TOTAL_SIZE / elapsed / 1e6, "MB/s");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string schema_file = argc > 1 ? argv[1] : "schema.sql";
+    int blocks = argc > 2 ? atoi(argv[2]) : 20000;
+
+    hash_init();
+
+    bench_chunkers();
+    bench_hashes();
+    bench_refs();
+    bench_patterns();
+    bench_tarfile();
+    bench_localdb(schema_file, blocks);
+
+    return 0;
+}
@@ -22,25 +22,40 @@
  * Python code can compute chunk breakpoints the C++ version runs much more
  * quickly.
  *
+ * Usage: cumulus-chunker-standalone [ALGORITHM], where the chunking algorithm
+ * defaults to "lbfs".
+ *
  * Protocol: The input is binary, consisting of a 4-byte record, giving the
  * length of a data buffer in network byte order, followed by the raw data.
  * The output is line-oriented: each line consists of whitespace-separated
  * integers giving the computed breakpoints.  An input with a specified length
- * of zero ends the computation. */
+ * of zero ends the computation.  Data is processed as it is read, so buffers
+ * of any size can be handled in a fixed amount of memory. */
 
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
-#include "third_party/chunk.h"
+#include <vector>
+
+#include "chunker.h"
 
-#define MAX_BUFSIZE (1 << 24)
+#define READ_SIZE (1 << 16)
 
-int main(int, char **)
+int main(int argc, char *argv[])
 {
-    char *buf = new char[MAX_BUFSIZE];
-    size_t *breakpoints = new size_t[chunk_compute_max_num_breaks(MAX_BUFSIZE)];
+    chunker_init();
+
+    const char *algorithm = argc > 1 ? argv[1] : "lbfs";
+    Chunker *chunker = Chunker::New(algorithm);
+    if (chunker == NULL) {
+        fprintf(stderr, "Unknown chunking algorithm: %s\n", algorithm);
+        return 1;
+    }
+
+    char *buf = new char[READ_SIZE];
+    std::vector<size_t> breakpoints;
 
     while (true) {
         int32_t blocklen;
@@ -52,16 +67,22 @@ int main(int, char **)
         blocklen = ntohl(blocklen);
         if (blocklen == 0)
             return 0;
-        if (blocklen < 0 || blocklen > MAX_BUFSIZE)
+        if (blocklen < 0)
             return 1;
 
-        if (fread(buf, 1, blocklen, stdin) != static_cast<size_t>(blocklen))
-            return 1;
+        breakpoints.clear();
+        while (blocklen > 0) {
+            size_t len = blocklen < READ_SIZE ? blocklen : READ_SIZE;
+            if (fread(buf, 1, len, stdin) != len)
+                return 1;
+            chunker->update(buf, len, &breakpoints);
+            blocklen -= len;
+        }
+        chunker->finish(&breakpoints);
 
-        int num_breakpoints = chunk_compute_breaks(buf, blocklen, breakpoints);
-        for (int i = 0; i < num_breakpoints; i++) {
+        for (size_t i = 0; i < breakpoints.size(); i++) {
             printf("%zd%c", breakpoints[i],
-                   i == num_breakpoints - 1 ? '\n' : ' ');
+                   i == breakpoints.size() - 1 ? '\n' : ' ');
         }
         fflush(stdout);
     }
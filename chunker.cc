@@ -0,0 +1,300 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Registry of chunking algorithms, and the implementations: the original
+ * LBFS-style Rabin fingerprint chunker (in third_party/chunk.cc) and a
+ * FastCDC chunker. */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "chunker.h"
+#include "third_party/chunk.h"
+
+using std::map;
+using std::min;
+using std::string;
+using std::vector;
+
+static string default_algorithm;
+static map<string, Chunker *(*)()> chunker_registry;
+
+void Chunker::Register(const string &name, Chunker *(*constructor)())
+{
+    chunker_registry.insert(make_pair(name, constructor));
+}
+
+Chunker *Chunker::New()
+{
+    return New(default_algorithm);
+}
+
+/* The registry is only modified by chunker_init(), so lookups are safe to make
+ * concurrently from multiple threads after that point. */
+Chunker *Chunker::New(const string &name)
+{
+    map<string, Chunker *(*)()>::const_iterator i
+        = chunker_registry.find(name);
+    if (i == chunker_registry.end())
+        return NULL;
+    else
+        return i->second();
+}
+
+bool Chunker::SetDefault(const string &name)
+{
+    if (chunker_registry.find(name) == chunker_registry.end())
+        return false;
+    default_algorithm = name;
+    return true;
+}
+
+int Chunker::compute_breaks(const char *buf, size_t len, size_t *breakpoints)
+{
+    reset();
+    int n = scan(buf, len, breakpoints);
+    if (len > 0 && (n == 0 || breakpoints[n - 1] != len - 1))
+        breakpoints[n++] = len - 1;
+    reset();
+    return n;
+}
+
+void Chunker::update(const char *buf, size_t len, vector<size_t> *breakpoints)
+{
+    if (len == 0)
+        return;
+
+    size_t start = breakpoints->size();
+    breakpoints->resize(start + max_num_breaks(len));
+    int n = scan(buf, len, &(*breakpoints)[start]);
+    breakpoints->resize(start + n);
+
+    for (size_t i = start; i < breakpoints->size(); i++)
+        (*breakpoints)[i] += position;
+    if (n > 0)
+        chunk_start = breakpoints->back() + 1;
+    position += len;
+}
+
+void Chunker::finish(vector<size_t> *breakpoints)
+{
+    if (position > chunk_start)
+        breakpoints->push_back(position - 1);
+    reset();
+}
+
+void Chunker::reset()
+{
+    position = 0;
+    chunk_start = 0;
+    reset_state();
+}
+
+/* Rabin fingerprints over a 48-byte window, as in LBFS. */
+class LbfsChunker : public Chunker {
+public:
+    LbfsChunker() : state(chunk_state_new()) { }
+    virtual ~LbfsChunker() { chunk_state_free(state); }
+
+    virtual int max_num_breaks(size_t buflen) const {
+        return chunk_compute_max_num_breaks(buflen);
+    }
+
+    virtual string name() const { return chunk_algorithm_name(); }
+
+protected:
+    virtual int scan(const char *buf, size_t len, size_t *breakpoints) {
+        return chunk_compute_breaks_incremental(state, buf, len, breakpoints);
+    }
+
+    virtual void reset_state() { chunk_state_reset(state); }
+
+private:
+    chunk_state *state;
+};
+
+/* FastCDC (Xia et al., USENIX ATC 2016): a Gear rolling hash, which costs a
+ * shift, an add, and one table lookup per byte, with cut-point skipping (the
+ * first min_size bytes of each chunk are not hashed at all) and normalized
+ * chunking (a harder breakpoint condition before the normal chunk size and an
+ * easier one after, which narrows the chunk size distribution).
+ *
+ * The gear table is generated from a fixed seed.  Changing it, or any of the
+ * parameters of a chunker built on it, changes the breakpoints computed; the
+ * algorithm name must be changed as well so that old signatures are not
+ * used. */
+static uint64_t gear[256];
+
+/* Fill the gear table with pseudo-random values from splitmix64. */
+static void init_gear()
+{
+    uint64_t state = UINT64_C(0x63756d756c757321);  // "cumulus!"
+    for (int i = 0; i < 256; i++) {
+        state += UINT64_C(0x9e3779b97f4a7c15);
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* A breakpoint is found where the top bits of the hash are all zero: bits + 2
+ * of them before the normal chunk size, and bits - 2 after. */
+FastCdcParams::FastCdcParams(size_t min_size, size_t normal_size,
+                             size_t max_size, int bits)
+    : min_size(min_size), normal_size(normal_size), max_size(max_size),
+      mask_small(~UINT64_C(0) << (64 - (bits + 2))),
+      mask_large(~UINT64_C(0) << (64 - (bits - 2)))
+{
+}
+
+size_t fastcdc_next_chunk(const FastCdcParams &params,
+                          const char *buf, size_t len)
+{
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(buf);
+
+    if (len <= params.min_size)
+        return len;
+    if (len > params.max_size)
+        len = params.max_size;
+    size_t normal = len < params.normal_size ? len : params.normal_size;
+
+    uint64_t hash = 0;
+    size_t i = params.min_size;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & params.mask_small))
+            return i + 1;
+    }
+    for (; i < len; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & params.mask_large))
+            return i + 1;
+    }
+    return len;
+}
+
+/* FastCDC for sub-file chunks.  The sizes are chosen to match the LBFS
+ * chunker: chunks are at least 2 KB, average about 6 KB, and are at most
+ * 64 KB, which is also the limit imposed by the 16-bit lengths in stored
+ * signatures. */
+static const size_t FASTCDC_TARGET_SIZE = 4096;
+static const FastCdcParams fastcdc_chunk_params(
+    2048, 2048 + FASTCDC_TARGET_SIZE, 65535, 12);
+
+class FastCdcChunker : public Chunker {
+public:
+    FastCdcChunker() : chunk_len(0), hash(0) { }
+
+    virtual int max_num_breaks(size_t buflen) const {
+        return buflen / fastcdc_chunk_params.min_size + 1;
+    }
+
+    virtual string name() const {
+        char buf[64];
+        sprintf(buf, "%s-%d", "fastcdc", (int)FASTCDC_TARGET_SIZE);
+        return buf;
+    }
+
+protected:
+    // The same algorithm as fastcdc_next_chunk, but able to stop and resume
+    // at any point in a chunk.
+    virtual int scan(const char *buf, size_t len, size_t *breakpoints) {
+        const FastCdcParams &params = fastcdc_chunk_params;
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(buf);
+        int n = 0;
+        size_t i = 0;
+
+        // Kept in a local, since stores to a member could alias data.
+        uint64_t h = hash;
+
+        while (i < len) {
+            if (chunk_len < params.min_size) {
+                size_t skip = min(params.min_size - chunk_len, len - i);
+                chunk_len += skip;
+                i += skip;
+                continue;
+            }
+
+            // Hash up to the end of the buffer or the maximum chunk size,
+            // using the harder breakpoint condition up to the normal size.
+            size_t end = min(len, i + (params.max_size - chunk_len));
+            size_t normal_end = i;
+            if (chunk_len < params.normal_size)
+                normal_end = min(end, i + (params.normal_size - chunk_len));
+
+            // j is left at the end of the data hashed.
+            size_t j = i;
+            bool found = false;
+            while (j < normal_end) {
+                h = (h << 1) + gear[data[j++]];
+                if (!(h & params.mask_small)) {
+                    found = true;
+                    break;
+                }
+            }
+            while (!found && j < end) {
+                h = (h << 1) + gear[data[j++]];
+                if (!(h & params.mask_large)) {
+                    found = true;
+                    break;
+                }
+            }
+
+            chunk_len += j - i;
+            i = j;
+            if (found || chunk_len == params.max_size) {
+                breakpoints[n++] = i - 1;
+                chunk_len = 0;
+                h = 0;
+            }
+        }
+
+        hash = h;
+        return n;
+    }
+
+    virtual void reset_state() {
+        chunk_len = 0;
+        hash = 0;
+    }
+
+private:
+    size_t chunk_len;           // Bytes in the chunk in progress
+    uint64_t hash;
+};
+
+template <class C> static Chunker *new_chunker()
+{
+    return new C;
+}
+
+void chunker_init()
+{
+    init_gear();
+
+    Chunker::Register("lbfs", new_chunker<LbfsChunker>);
+    Chunker::Register("fastcdc", new_chunker<FastCdcChunker>);
+    default_algorithm = "lbfs";
+}
@@ -0,0 +1,105 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A generic interface to the content-defined chunking algorithms used for
+ * sub-file incrementals.  Chunk signatures are stored in the local database
+ * tagged with the name of the algorithm which produced them, and signatures
+ * from a different algorithm are never compared, so the name must change
+ * whenever the breakpoints an algorithm computes could change. */
+
+#ifndef _CUMULUS_CHUNKER_H
+#define _CUMULUS_CHUNKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* A Chunker can split a complete buffer into chunks with compute_breaks, or
+ * follow a stream of data supplied in pieces of any size (such as the results
+ * of successive reads) with update and finish; both find the same chunks.
+ * Chunkers hold state, and so a Chunker object must not be shared between
+ * threads. */
+class Chunker {
+public:
+    Chunker() : position(0), chunk_start(0) { }
+    virtual ~Chunker() { }
+
+    // Upper bound on the number of chunks a buffer of the given size may be
+    // split into, for sizing the breakpoints array.
+    virtual int max_num_breaks(size_t buflen) const = 0;
+
+    // Compute the offsets of the last byte of each chunk in buf, storing them
+    // in breakpoints and returning the number of chunks.  This resets any
+    // stream in progress.
+    int compute_breaks(const char *buf, size_t len, size_t *breakpoints);
+
+    // Incremental interface.  update() consumes the next len bytes of the
+    // stream and appends the offsets (from the start of the stream) of the
+    // last byte of each chunk completed to breakpoints.  finish() ends the
+    // final, partial chunk, and resets the Chunker for a new stream.
+    void update(const char *buf, size_t len,
+                std::vector<size_t> *breakpoints);
+    void finish(std::vector<size_t> *breakpoints);
+    void reset();
+
+    // Returns the name of the algorithm, including its parameters.
+    virtual std::string name() const = 0;
+
+    static void Register(const std::string &name, Chunker *(*constructor)());
+    static Chunker *New();
+    static Chunker *New(const std::string &name);
+
+    // Select the algorithm returned by New(); returns false if the name is
+    // not registered.  Must be called before any threads use New().
+    static bool SetDefault(const std::string &name);
+
+protected:
+    // Implemented by each algorithm: continue the chunk in progress through
+    // buf, storing the offsets within buf of the last byte of each chunk
+    // which ends there (at most max_num_breaks(len)) and returning the number
+    // found; and discard any chunk in progress.
+    virtual int scan(const char *buf, size_t len, size_t *breakpoints) = 0;
+    virtual void reset_state() = 0;
+
+private:
+    size_t position;            // Bytes of the stream consumed so far
+    size_t chunk_start;         // Offset of the chunk in progress
+};
+
+void chunker_init();
+
+/* The FastCDC algorithm used by the "fastcdc" chunker is also available
+ * directly, with other parameters, for splitting files into blocks.  Chunks
+ * are between min_size and max_size bytes long, and (beyond min_size) a
+ * breakpoint is expected about every 2^bits bytes. */
+struct FastCdcParams {
+    FastCdcParams(size_t min_size, size_t normal_size, size_t max_size,
+                  int bits);
+
+    size_t min_size, normal_size, max_size;
+    uint64_t mask_small, mask_large;
+};
+
+/* Returns the length of the first chunk in buf.  If len is less than max_size,
+ * the chunk may be cut short by the end of the buffer. */
+size_t fastcdc_next_chunk(const FastCdcParams &params,
+                          const char *buf, size_t len);
+
+#endif // _CUMULUS_CHUNKER_H
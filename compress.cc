@@ -0,0 +1,450 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Compression of finished segments, possibly in parallel using a pool of
+ * worker threads.  See compress.h for an overview. */
+
+#include <assert.h>
+#include <bzlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "compress.h"
+#include "hash.h"
+#include "store.h"
+#include "util.h"
+
+using std::list;
+using std::map;
+using std::string;
+using std::vector;
+
+/* Write out a buffer completely, retrying after short writes. */
+static void write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(fd, data, len);
+
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Write error: %m\n");
+            fatal("Write error");
+        }
+
+        len -= res;
+        data += res;
+    }
+}
+
+/* bzip2, via libbz2.  The default block size matches "bzip2 -c". */
+class Bzip2Codec : public Codec {
+public:
+    Bzip2Codec(int level) : level(level) { }
+
+    virtual void compress(const string &input, string *output) {
+        // Worst-case expansion, as documented for BZ2_bzBuffToBuffCompress.
+        unsigned int size = input.size() + input.size() / 100 + 600;
+        output->resize(size);
+        int rc = BZ2_bzBuffToBuffCompress(&(*output)[0], &size,
+                                          const_cast<char *>(input.data()),
+                                          input.size(), level, 0, 0);
+        if (rc != BZ_OK)
+            fatal("bzip2 compression error");
+        output->resize(size);
+    }
+
+    virtual string extension() const { return ".bz2"; }
+
+private:
+    int level;
+};
+
+/* gzip, via zlib. */
+class GzipCodec : public Codec {
+public:
+    GzipCodec(int level) : level(level) { }
+
+    virtual void compress(const string &input, string *output) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // A window size of 15, plus 16 to select a gzip header and trailer.
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            fatal("Unable to initialize gzip compression");
+
+        output->resize(deflateBound(&stream, input.size()));
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = input.size();
+        stream.next_out = (Bytef *)&(*output)[0];
+        stream.avail_out = output->size();
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+            fatal("gzip compression error");
+        output->resize(stream.total_out);
+        deflateEnd(&stream);
+    }
+
+    virtual string extension() const { return ".gz"; }
+
+private:
+    int level;
+};
+
+/* xz, via liblzma. */
+class XzCodec : public Codec {
+public:
+    XzCodec(int level) : level(level) { }
+
+    virtual void compress(const string &input, string *output) {
+        size_t pos = 0;
+        output->resize(lzma_stream_buffer_bound(input.size()));
+        lzma_ret rc = lzma_easy_buffer_encode(
+            level, LZMA_CHECK_CRC64, NULL,
+            (const uint8_t *)input.data(), input.size(),
+            (uint8_t *)&(*output)[0], &pos, output->size());
+        if (rc != LZMA_OK)
+            fatal("xz compression error");
+        output->resize(pos);
+    }
+
+    virtual string extension() const { return ".xz"; }
+
+private:
+    int level;
+};
+
+#ifdef HAVE_ZSTD
+/* zstd, via libzstd. */
+class ZstdCodec : public Codec {
+public:
+    ZstdCodec(int level) : level(level) { }
+
+    virtual void compress(const string &input, string *output) {
+        output->resize(ZSTD_compressBound(input.size()));
+        size_t size = ZSTD_compress(&(*output)[0], output->size(),
+                                    input.data(), input.size(), level);
+        if (ZSTD_isError(size))
+            fatal(string("zstd compression error: ")
+                  + ZSTD_getErrorName(size));
+        output->resize(size);
+    }
+
+    virtual string extension() const { return ".zst"; }
+
+private:
+    int level;
+};
+#endif
+
+#ifdef HAVE_LZ4
+/* lz4, via liblz4.  This writes the LZ4 frame format, as "lz4 -c" does. */
+class Lz4Codec : public Codec {
+public:
+    Lz4Codec(int level) : level(level) { }
+
+    virtual void compress(const string &input, string *output) {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.contentSize = input.size();
+        prefs.compressionLevel = level;
+
+        output->resize(LZ4F_compressFrameBound(input.size(), &prefs));
+        size_t size = LZ4F_compressFrame(&(*output)[0], output->size(),
+                                         input.data(), input.size(), &prefs);
+        if (LZ4F_isError(size))
+            fatal(string("lz4 compression error: ")
+                  + LZ4F_getErrorName(size));
+        output->resize(size);
+    }
+
+    virtual string extension() const { return ".lz4"; }
+
+private:
+    int level;
+};
+#endif
+
+template <class C, int level> static Codec *new_codec()
+{
+    return new C(level);
+}
+
+static map<string, Codec *(*)()> codec_registry;
+
+void Codec::Register(const string &name, Codec *(*constructor)())
+{
+    codec_registry.insert(make_pair(name, constructor));
+}
+
+/* The registry is only modified by codec_init(), so lookups are safe to make
+ * concurrently from multiple threads after that point. */
+Codec *Codec::New(const string &name)
+{
+    map<string, Codec *(*)()>::const_iterator i = codec_registry.find(name);
+    if (i == codec_registry.end())
+        return NULL;
+    else
+        return i->second();
+}
+
+vector<string> Codec::names()
+{
+    vector<string> result;
+    for (map<string, Codec *(*)()>::const_iterator i = codec_registry.begin();
+         i != codec_registry.end(); ++i)
+        result.push_back(i->first);
+    return result;
+}
+
+/* Filter commands whose output can be produced in-process by a codec. */
+static const struct {
+    const char *command;
+    const char *codec;
+} builtin_filters[] = {
+    {"bzip2 -c", "bzip2"},
+    {"gzip -c", "gzip"},
+    {"xz -c", "xz"},
+    {NULL, NULL},
+};
+
+string Codec::for_filter(const string &filter)
+{
+    for (int i = 0; builtin_filters[i].command != NULL; i++) {
+        if (filter == builtin_filters[i].command)
+            return builtin_filters[i].codec;
+    }
+    return "";
+}
+
+void codec_init()
+{
+    Codec::Register("bzip2", new_codec<Bzip2Codec, 9>);
+    Codec::Register("gzip", new_codec<GzipCodec, 6>);
+    Codec::Register("xz", new_codec<XzCodec, 6>);
+#ifdef HAVE_ZSTD
+    Codec::Register("zstd", new_codec<ZstdCodec, 3>);
+    Codec::Register("zstd-1", new_codec<ZstdCodec, 1>);
+    Codec::Register("zstd-3", new_codec<ZstdCodec, 3>);
+    Codec::Register("zstd-9", new_codec<ZstdCodec, 9>);
+    Codec::Register("zstd-19", new_codec<ZstdCodec, 19>);
+#endif
+#ifdef HAVE_LZ4
+    Codec::Register("lz4", new_codec<Lz4Codec, 0>);
+#endif
+}
+
+/* The output of an external filter program is passed through a pipe and
+ * copied to the output file by a separate thread, which also computes the
+ * checksum, while the calling thread writes the input to the filter. */
+struct OutputTee {
+    int fd_in, fd_out;
+    Hash *hash;
+    size_t size;
+};
+
+static void *run_output_tee(void *arg)
+{
+    OutputTee *tee = static_cast<OutputTee *>(arg);
+    char buf[65536];
+
+    while (true) {
+        ssize_t res = read(tee->fd_in, buf, sizeof(buf));
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("Error reading filter output");
+        } else if (res == 0) {
+            break;
+        }
+
+        tee->hash->update(buf, res);
+        write_all(tee->fd_out, buf, res);
+        tee->size += res;
+    }
+
+    return NULL;
+}
+
+void compress_segment(CompressionJob *job)
+{
+    scoped_ptr<Hash> hash(Hash::New());
+
+    if (!job->codec.empty()) {
+        scoped_ptr<Codec> codec(Codec::New(job->codec));
+        if (codec == NULL)
+            fatal("Unknown compression method: " + job->codec);
+
+        string output;
+        codec->compress(job->data, &output);
+        hash->update(output.data(), output.size());
+        job->output_size = output.size();
+        write_all(job->fd, output.data(), output.size());
+    } else if (job->filter.empty()) {
+        hash->update(job->data.data(), job->data.size());
+        job->output_size = job->data.size();
+        write_all(job->fd, job->data.data(), job->data.size());
+    } else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            fatal("Unable to create pipe for filter output");
+
+        OutputTee tee;
+        tee.fd_in = fds[0];
+        tee.fd_out = job->fd;
+        tee.hash = hash.get();
+        tee.size = 0;
+        pthread_t tee_thread;
+        if (pthread_create(&tee_thread, NULL, run_output_tee, &tee) != 0)
+            fatal("Unable to create filter output thread");
+
+        // The filter's copy of the write end of the pipe is closed by
+        // wait(), after which the tee thread sees the end of the output.
+        scoped_ptr<FileFilter> filter(FileFilter::New(fds[1],
+                                                      job->filter.c_str()));
+        write_all(filter->get_wrapped_fd(), job->data.data(),
+                  job->data.size());
+        if (close(filter->get_wrapped_fd()) != 0)
+            fatal("Error closing segment file");
+        if (filter->wait() != 0)
+            fatal("Filter process error");
+
+        pthread_join(tee_thread, NULL);
+        close(fds[0]);
+        job->output_size = tee.size;
+    }
+
+    if (close(job->fd) != 0)
+        fatal("Error closing segment file");
+    job->checksum = hash->digest_str();
+}
+
+CompressionPool::CompressionPool(int num_threads)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    terminate = false;
+
+    threads.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL,
+                           CompressionPool::start_worker_thread,
+                           (void *)this) != 0) {
+            fprintf(stderr, "Cannot create compression thread: %m\n");
+            fatal("pthread_create");
+        }
+    }
+}
+
+/* Shut down the worker threads.  All submitted jobs must have completed. */
+CompressionPool::~CompressionPool()
+{
+    pthread_mutex_lock(&lock);
+    assert(queue.empty());
+    terminate = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Warning: Unable to join compression thread: %m\n");
+        }
+    }
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void CompressionPool::submit(CompressionJob *job)
+{
+    job->done = false;
+
+    if (threads.empty()) {
+        compress_segment(job);
+        job->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    queue.push_back(job);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool CompressionPool::is_done(CompressionJob *job)
+{
+    pthread_mutex_lock(&lock);
+    bool result = job->done;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void CompressionPool::wait(CompressionJob *job)
+{
+    pthread_mutex_lock(&lock);
+    while (!job->done)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void *CompressionPool::start_worker_thread(void *arg)
+{
+    CompressionPool *pool = static_cast<CompressionPool *>(arg);
+    pool->worker_thread();
+    return NULL;
+}
+
+void CompressionPool::worker_thread()
+{
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (queue.empty() && !terminate)
+            pthread_cond_wait(&cond, &lock);
+        if (terminate) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        CompressionJob *job = queue.front();
+        queue.pop_front();
+        pthread_mutex_unlock(&lock);
+
+        compress_segment(job);
+
+        pthread_mutex_lock(&lock);
+        job->done = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+}
@@ -0,0 +1,114 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Compression of finished segments.  A segment is built up in memory as an
+ * uncompressed TAR file, and once it is complete it is handed off to be
+ * compressed (or, more generally, passed through the segment filter) and
+ * written to its output file.  A CompressionPool runs this work for several
+ * segments at once in worker threads.
+ *
+ * Compression is normally done in-process by a Codec, chosen by name from a
+ * registry of built-in compression methods.  Codecs produce the same format
+ * as the corresponding command-line tool, so that segments can be read back
+ * by piping them through the matching decompressor.  Alternatively, segments
+ * may be passed through an arbitrary external filter program. */
+
+#ifndef _CUMULUS_COMPRESS_H
+#define _CUMULUS_COMPRESS_H
+
+#include <pthread.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+/* An in-process compression method, modeled on Hash. */
+class Codec {
+public:
+    virtual ~Codec() { }
+
+    // Compress the whole of input, replacing the contents of output.
+    virtual void compress(const std::string &input, std::string *output) = 0;
+
+    // Filename extension for compressed files, such as ".bz2".
+    virtual std::string extension() const = 0;
+
+    static void Register(const std::string &name, Codec *(*constructor)());
+    static Codec *New(const std::string &name);
+
+    // Names of all registered codecs, in sorted order.
+    static std::vector<std::string> names();
+
+    // Returns the name of a codec which produces the same output as the
+    // given filter command, or an empty string if there is none.
+    static std::string for_filter(const std::string &filter);
+};
+
+void codec_init();
+
+/* A single segment to be compressed. */
+struct CompressionJob {
+    std::string data;           // Uncompressed segment contents
+    int fd;                     // Output file; closed once the job is done
+
+    // How to compress: with the named codec if codec is non-empty, and
+    // otherwise through the filter program (if any).
+    std::string codec;
+    std::string filter;
+
+    // The checksum (as from Hash::digest_str) and size of the data written
+    // to fd, computed as it is written so the file need not be read back.
+    std::string checksum;
+    size_t output_size;
+
+    bool done;                  // Set by the pool when the job completes
+};
+
+/* Perform the work for a job in the calling thread: compress job->data,
+ * write the result to job->fd, and close it.  Errors are fatal. */
+void compress_segment(CompressionJob *job);
+
+class CompressionPool {
+public:
+    // With num_threads zero, jobs are run in the thread calling submit().
+    CompressionPool(int num_threads);
+    ~CompressionPool();
+
+    // Queue a job.  The caller retains ownership, but must not touch the job
+    // again until is_done() returns true or wait() returns.
+    void submit(CompressionJob *job);
+
+    bool is_done(CompressionJob *job);
+    void wait(CompressionJob *job);
+
+    int get_num_threads() const { return threads.size(); }
+
+private:
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    bool terminate;             // Set when threads should shut down
+    std::list<CompressionJob *> queue;
+
+    void worker_thread();
+    static void *start_worker_thread(void *arg);
+};
+
+#endif // _CUMULUS_COMPRESS_H
@@ -0,0 +1,46 @@
+-- SQL script for upgrading the local database to the format expected for
+-- Cumulus schema version 0.12 (from a version 0.11 database).
+--
+-- This script should be loaded after connecting to the database to be
+-- upgraded.  It uses the unhex() function, which requires SQLite 3.41 or
+-- later.  Running VACUUM afterwards will reclaim the space freed.
+
+-- Block checksums are now stored in binary form: an id for the checksum
+-- algorithm plus the raw digest, instead of text of the form
+-- "algorithm=hexdigest".  Rather than upgrade the block_index table in-place,
+-- we create a new table and then rename it over the old one.  Block ids are
+-- preserved, so subblock_signatures does not need to change.
+create table checksum_algorithms (
+    algorithmid integer primary key,
+    name text unique not null
+);
+
+insert or ignore into checksum_algorithms(name)
+    select distinct substr(checksum, 1, instr(checksum, '=') - 1)
+    from block_index where instr(checksum, '=') > 0;
+
+create table block_index_new (
+    blockid integer primary key,
+    segmentid integer not null,
+    object text not null,
+    algorithmid integer,
+    checksum blob,
+    size integer,
+    timestamp datetime,
+    expired integer
+);
+
+insert into block_index_new
+    select blockid, segmentid, object,
+           (select algorithmid from checksum_algorithms
+            where name = substr(b.checksum, 1, instr(b.checksum, '=') - 1)),
+           unhex(substr(b.checksum, instr(b.checksum, '=') + 1)),
+           size, timestamp, expired
+    from block_index b;
+
+drop table block_index;
+alter table block_index_new rename to block_index;
+create index block_content_index on block_index(checksum);
+create unique index block_name_index on block_index(segmentid, object);
+
+update schema_version set version = '0.12', major = 0, minor = 12;
@@ -0,0 +1,19 @@
+-- SQL script for upgrading the local database to the format expected for
+-- Cumulus schema version 0.13 (from a version 0.12 database).
+--
+-- This script should be loaded after connecting to the database to be
+-- upgraded.
+
+-- The file_index table lets moved and touched files be recognized without
+-- looking up each block.  It starts out empty and is filled in as files are
+-- backed up.
+create table file_index (
+    inode text primary key,
+    size integer not null,
+    mtime integer not null,
+    checksum text not null,
+    blocks text not null,
+    snapshotid integer not null
+);
+
+update schema_version set version = '0.13', major = 0, minor = 13;
@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "hash.h"
 
@@ -40,13 +41,24 @@ Hash *Hash::New()
     return New(default_algorithm);
 }
 
+/* The registry is only modified by hash_init(), so lookups are safe to make
+ * concurrently from multiple threads after that point. */
 Hash *Hash::New(const std::string& name)
 {
-    Hash *(*constructor)() = hash_registry[name];
-    if (!constructor)
+    map<string, Hash *(*)()>::const_iterator i = hash_registry.find(name);
+    if (i == hash_registry.end())
         return NULL;
     else
-        return constructor();
+        return i->second();
+}
+
+std::vector<std::string> Hash::names()
+{
+    std::vector<std::string> result;
+    for (map<string, Hash *(*)()>::const_iterator i = hash_registry.begin();
+         i != hash_registry.end(); ++i)
+        result.push_back(i->first);
+    return result;
 }
 
 std::string Hash::hash_file(const char *filename)
@@ -105,12 +117,22 @@ string Hash::digest_str()
     return name() + "=" + hexbuf;
 }
 
-void sha1_register();
-void sha256_register();
+bool Hash::SetDefault(const std::string& name)
+{
+    if (hash_registry.find(name) == hash_registry.end())
+        return false;
+    default_algorithm = name;
+    return true;
+}
+
+void sha1_register(bool accelerated);
+void sha256_register(bool accelerated);
+void blake3_register(bool accelerated);
 
-void hash_init()
+void hash_init(bool accelerated)
 {
-    sha1_register();
-    sha256_register();
+    sha1_register(accelerated);
+    sha256_register(accelerated);
+    blake3_register(accelerated);
     default_algorithm = "sha224";
 }
@@ -25,6 +25,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 /* An object-oriented wrapper around checksumming functionality. */
 class Hash {
@@ -53,6 +54,13 @@ public:
     static Hash *New();
     static Hash *New(const std::string& name);
 
+    // Select the algorithm returned by New(); returns false if the name is
+    // not registered.  Must be called before any threads use New().
+    static bool SetDefault(const std::string& name);
+
+    // Names of all registered hash algorithms, in sorted order.
+    static std::vector<std::string> names();
+
     // Computes and returns the hash of a file on disk.
     static std::string hash_file(const char *filename);
 
@@ -63,6 +71,9 @@ private:
     const uint8_t *digest_bytes;
 };
 
-void hash_init();
+/* Registers the available hash algorithms.  Where the processor supports it,
+ * hashes are computed using instruction set extensions (such as the x86 SHA
+ * extensions) unless accelerated is false; the results are the same. */
+void hash_init(bool accelerated = true);
 
 #endif
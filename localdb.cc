@@ -31,9 +31,13 @@
 #include <string.h>
 #include <sqlite3.h>
 
+#include <math.h>
+#include <stdint.h>
+
 #include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "localdb.h"
 #include "store.h"
@@ -44,9 +48,172 @@ using std::max;
 using std::min;
 using std::set;
 using std::string;
+using std::vector;
 
 static const int SCHEMA_MAJOR = 0;
-static const int SCHEMA_MINOR = 11;
+static const int SCHEMA_MINOR = 13;
+
+/* Value of a hexadecimal digit, or -1 if c is not one.  This is on the path
+ * of every block lookup, hence the unsigned-compare tricks. */
+static inline int hex_value(char c)
+{
+    unsigned int d = (unsigned char)c - '0';
+    if (d < 10)
+        return d;
+    d = ((unsigned char)c | 0x20) - 'a';
+    if (d < 6)
+        return d + 10;
+    return -1;
+}
+
+/* A Bloom filter over block checksums.  A negative answer from may_contain()
+ * means the checksum is definitely not in the database; a positive answer
+ * may be wrong, with a probability which depends on the size of the filter
+ * and the number of checksums added. */
+class ChecksumFilter {
+public:
+    ChecksumFilter(size_t size, int64_t expected_entries);
+
+    void add(const string &checksum);
+    bool may_contain(const string &checksum) const;
+
+    size_t size() const { return bits.size() * sizeof(uint64_t); }
+    int num_hashes() const { return hashes; }
+    int64_t num_entries() const { return entries; }
+    double false_positive_rate() const;
+
+private:
+    vector<uint64_t> bits;
+    uint64_t num_bits;
+    int hashes;
+    int64_t entries;
+
+    static void hash(const string &checksum, uint64_t *h1, uint64_t *h2);
+};
+
+ChecksumFilter::ChecksumFilter(size_t size, int64_t expected_entries)
+    : bits(max(size / sizeof(uint64_t), (size_t)1)), entries(0)
+{
+    num_bits = bits.size() * 64;
+
+    // Choose the number of hash functions that minimizes the false positive
+    // rate for the expected number of entries.
+    double per_entry = (double)num_bits / max(expected_entries, (int64_t)1);
+    hashes = (int)(per_entry * M_LN2 + 0.5);
+    hashes = max(1, min(hashes, 16));
+}
+
+/* The filter is fed the raw digest bytes as stored in the block_index table,
+ * without the algorithm id, so digests from different algorithms share the
+ * filter (a collision between them only causes a false positive).  Digests
+ * vary in length by algorithm, so rather than slicing bits out of them
+ * directly all bytes are hashed (64-bit FNV-1a, with a second hash derived
+ * from it for double hashing). */
+void ChecksumFilter::hash(const string &checksum, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < checksum.size(); i++) {
+        h ^= (unsigned char)checksum[i];
+        h *= 1099511628211ULL;
+    }
+    *h1 = h;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    *h2 = h | 1;
+}
+
+void ChecksumFilter::add(const string &checksum)
+{
+    uint64_t h1, h2;
+    hash(checksum, &h1, &h2);
+    for (int i = 0; i < hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % num_bits;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    entries++;
+}
+
+bool ChecksumFilter::may_contain(const string &checksum) const
+{
+    uint64_t h1, h2;
+    hash(checksum, &h1, &h2);
+    for (int i = 0; i < hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % num_bits;
+        if (!(bits[bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+double ChecksumFilter::false_positive_rate() const
+{
+    return pow(1.0 - exp(-(double)hashes * entries / num_bits), hashes);
+}
+
+/* SQL for each of the statements in the statement cache, indexed by
+ * CachedStatement. */
+const char *const LocalDb::cached_statement_sql[NUM_CACHED_STATEMENTS] = {
+    // STMT_SEGMENT_INSERT
+    "insert or ignore into segments(segment) values (?)",
+    // STMT_SEGMENT_TO_ID
+    "select segmentid from segments where segment = ?",
+    // STMT_ID_TO_SEGMENT
+    "select segment from segments where segmentid = ?",
+    // STMT_ALGORITHM_INSERT
+    "insert or ignore into checksum_algorithms(name) values (?)",
+    // STMT_ALGORITHM_TO_ID
+    "select algorithmid from checksum_algorithms where name = ?",
+    // STMT_STORE_OBJECT
+    "insert into block_index(segmentid, object, algorithmid, checksum, size, "
+    "                        timestamp) "
+    "values (?, ?, ?, ?, ?, julianday('now'))",
+    // STMT_STORE_OBJECT_AGE
+    "insert into block_index(segmentid, object, algorithmid, checksum, size, "
+    "                        timestamp) "
+    "values (?, ?, ?, ?, ?, ?)",
+    // STMT_FIND_OBJECT
+    "select segmentid, object from block_index "
+    "where checksum = ? and algorithmid = ? and size = ? and expired is null",
+    // STMT_IS_OLD_OBJECT
+    "select segmentid, object, julianday(timestamp), expired "
+    "from block_index where checksum = ? and algorithmid = ? and size = ?",
+    // STMT_IS_AVAILABLE
+    "select count(*) from block_index "
+    "where segmentid = ? and object = ? and expired is null",
+    // STMT_SNAPSHOT_REFS_SIZE
+    "select size from snapshot_refs where segmentid = ? and object = ?",
+    // STMT_BLOCK_SIZE
+    "select size from block_index where segmentid = ? and object = ?",
+    // STMT_SNAPSHOT_REFS_UPDATE
+    "insert or replace into snapshot_refs(segmentid, object, size) "
+    "values (?, ?, ?)",
+    // STMT_LOAD_SIGNATURES
+    "select signatures, algorithm from subblock_signatures "
+    "where blockid = (select blockid from block_index "
+    "                 where segmentid = ? and object = ?)",
+    // STMT_BLOCK_ID
+    "select blockid from block_index where segmentid = ? and object = ?",
+    // STMT_STORE_SIGNATURES
+    "insert or replace "
+    "into subblock_signatures(blockid, algorithm, signatures) "
+    "values (?, ?, ?)",
+    // STMT_SEGMENT_AVAILABLE
+    "select count(*), count(expired) from block_index where segmentid = ?",
+    // STMT_FIND_FILE
+    "select mtime, checksum, blocks, "
+    "       coalesce(cast(strftime('%s', timestamp) as integer), 0) "
+    "from file_index left join snapshots using (snapshotid) "
+    "where inode = ? and size = ?",
+    // STMT_STORE_FILE
+    "insert or replace "
+    "into file_index(inode, size, mtime, checksum, blocks, snapshotid) "
+    "values (?, ?, ?, ?, ?, ?)",
+    // STMT_TOUCH_FILE
+    "update file_index set snapshotid = ? "
+    "where inode = ? and size = ? and mtime = ?",
+};
 
 /* Helper function to prepare a statement for execution in the current
  * database. */
@@ -65,6 +232,16 @@ sqlite3_stmt *LocalDb::Prepare(const char *sql)
     return stmt;
 }
 
+/* Return a statement from the statement cache, ready to have its parameters
+ * bound and be executed.  Callers should sqlite3_reset() the statement when
+ * finished with it instead of finalizing it. */
+sqlite3_stmt *LocalDb::Cached(CachedStatement which)
+{
+    sqlite3_stmt *stmt = cached_statements[which];
+    sqlite3_reset(stmt);
+    return stmt;
+}
+
 void LocalDb::ReportError(int rc)
 {
     fprintf(stderr, "Result code: %d\n", rc);
@@ -72,7 +249,7 @@ void LocalDb::ReportError(int rc)
 }
 
 void LocalDb::Open(const char *path, const char *snapshot_name,
-                   const char *snapshot_scheme)
+                   const char *snapshot_scheme, size_t filter_size)
 {
     int rc;
 
@@ -162,12 +339,86 @@ void LocalDb::Open(const char *path, const char *snapshot_name,
         sqlite3_close(db);
         fatal("Database initialization");
     }
+
+    pending_refs.clear();
+    refs_flushed = false;
+
+    /* Prepare the statements used for each block, now that all the tables
+     * they refer to exist. */
+    for (int i = 0; i < NUM_CACHED_STATEMENTS; i++)
+        cached_statements[i] = Prepare(cached_statement_sql[i]);
+
+    checksum_filter = NULL;
+    filter_lookups = filter_misses = 0;
+    if (filter_size > 0)
+        LoadChecksumFilter(filter_size);
+}
+
+/* Build the checksum filter from all blocks in the database, including
+ * expired ones, since IsOldObject also reports on those. */
+void LocalDb::LoadChecksumFilter(size_t filter_size)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    int64_t count = 0;
+
+    stmt = Prepare("select count(*) from block_index "
+                   "where checksum is not null");
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        count = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    // Leave room for the blocks added by this snapshot.
+    checksum_filter = new ChecksumFilter(filter_size, count + count / 4 + 1024);
+
+    stmt = Prepare("select checksum from block_index "
+                   "where checksum is not null");
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *digest
+            = reinterpret_cast<const char *>(sqlite3_column_blob(stmt, 0));
+        checksum_filter->add(string(digest, sqlite3_column_bytes(stmt, 0)));
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not load block checksums!\n");
+        ReportError(rc);
+    }
+    sqlite3_finalize(stmt);
+}
+
+void LocalDb::DumpStats()
+{
+    if (checksum_filter == NULL)
+        return;
+
+    printf("Checksum filter:\n");
+    printf("    size: %zd bytes, %d hashes\n",
+           checksum_filter->size(), checksum_filter->num_hashes());
+    printf("    checksums: %lld (%.3f%% false positive rate)\n",
+           (long long)checksum_filter->num_entries(),
+           checksum_filter->false_positive_rate() * 100);
+    printf("    lookups: %lld (%lld answered by filter)\n",
+           (long long)filter_lookups, (long long)filter_misses);
+}
+
+/* Returns false if the digest is known not to be in the database. */
+bool LocalDb::MayContainChecksum(const string &digest)
+{
+    if (checksum_filter == NULL)
+        return true;
+
+    filter_lookups++;
+    if (checksum_filter->may_contain(digest))
+        return true;
+    filter_misses++;
+    return false;
 }
 
 void LocalDb::Close()
 {
     int rc;
 
+    FlushObjectRefs();
+
     /* Summarize the snapshot_refs table into segment_utilization. */
     sqlite3_stmt *stmt = Prepare(
         "insert or replace into segment_utilization "
@@ -183,6 +434,15 @@ void LocalDb::Close()
     }
     sqlite3_finalize(stmt);
 
+    for (int i = 0; i < NUM_CACHED_STATEMENTS; i++)
+        sqlite3_finalize(cached_statements[i]);
+    segment_ids.clear();
+    segment_names.clear();
+    available_segments.clear();
+    algorithm_ids.clear();
+    delete checksum_filter;
+    checksum_filter = NULL;
+
     /* Commit changes to the database and close. */
     rc = sqlite3_exec(db, "commit", NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
@@ -198,16 +458,20 @@ int64_t LocalDb::SegmentToId(const string &segment)
     sqlite3_stmt *stmt;
     int64_t result;
 
-    stmt = Prepare("insert or ignore into segments(segment) values (?)");
+    map<string, int64_t>::const_iterator i = segment_ids.find(segment);
+    if (i != segment_ids.end())
+        return i->second;
+
+    stmt = Cached(STMT_SEGMENT_INSERT);
     sqlite3_bind_text(stmt, 1, segment.c_str(), segment.size(),
                       SQLITE_TRANSIENT);
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
         fatal("Could not execute INSERT statement!");
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
-    stmt = Prepare("select segmentid from segments where segment = ?");
+    stmt = Cached(STMT_SEGMENT_TO_ID);
     sqlite3_bind_text(stmt, 1, segment.c_str(), segment.size(),
                       SQLITE_TRANSIENT);
 
@@ -220,7 +484,10 @@ int64_t LocalDb::SegmentToId(const string &segment)
         fatal("Error executing find segment by id query");
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+
+    segment_ids[segment] = result;
+    segment_names[result] = segment;
 
     return result;
 }
@@ -231,7 +498,11 @@ string LocalDb::IdToSegment(int64_t segmentid)
     sqlite3_stmt *stmt;
     string result;
 
-    stmt = Prepare("select segment from segments where segmentid = ?");
+    map<int64_t, string>::const_iterator i = segment_names.find(segmentid);
+    if (i != segment_names.end())
+        return i->second;
+
+    stmt = Cached(STMT_ID_TO_SEGMENT);
     sqlite3_bind_int64(stmt, 1, segmentid);
 
     rc = sqlite3_step(stmt);
@@ -243,11 +514,86 @@ string LocalDb::IdToSegment(int64_t segmentid)
         fatal("Error executing find segment by id query");
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+
+    segment_ids[result] = segmentid;
+    segment_names[segmentid] = result;
 
     return result;
 }
 
+int64_t LocalDb::AlgorithmToId(const string &algorithm)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    int64_t result;
+
+    map<string, int64_t>::const_iterator i = algorithm_ids.find(algorithm);
+    if (i != algorithm_ids.end())
+        return i->second;
+
+    stmt = Cached(STMT_ALGORITHM_INSERT);
+    sqlite3_bind_text(stmt, 1, algorithm.c_str(), algorithm.size(),
+                      SQLITE_TRANSIENT);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fatal("Could not execute INSERT statement!");
+    }
+    sqlite3_reset(stmt);
+
+    stmt = Cached(STMT_ALGORITHM_TO_ID);
+    sqlite3_bind_text(stmt, 1, algorithm.c_str(), algorithm.size(),
+                      SQLITE_TRANSIENT);
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        fatal("No checksum algorithm found by name");
+    } else if (rc == SQLITE_ROW) {
+        result = sqlite3_column_int64(stmt, 0);
+    } else {
+        fatal("Error executing find checksum algorithm query");
+    }
+
+    sqlite3_reset(stmt);
+
+    algorithm_ids[algorithm] = result;
+
+    return result;
+}
+
+/* Convert a checksum string ("algorithm=hexdigest") to the form stored in
+ * block_index: an algorithm id and the raw digest bytes.  Returns false if
+ * the checksum is not in the expected format. */
+bool LocalDb::EncodeChecksum(const string &checksum, int64_t *algorithmid,
+                             string *digest)
+{
+    size_t pos = checksum.find('=');
+    if (pos == string::npos || (checksum.size() - pos - 1) % 2 != 0)
+        return false;
+
+    const char *hex = checksum.data() + pos + 1;
+    digest->resize((checksum.size() - pos - 1) / 2);
+    for (size_t i = 0; i < digest->size(); i++) {
+        int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        (*digest)[i] = (char)(hi << 4 | lo);
+    }
+
+    // Nearly all checksums use the same algorithm, so check the known ones
+    // before building a string to look up.
+    for (map<string, int64_t>::const_iterator i = algorithm_ids.begin();
+         i != algorithm_ids.end(); ++i) {
+        if (i->first.size() == pos && checksum.compare(0, pos, i->first) == 0) {
+            *algorithmid = i->second;
+            return true;
+        }
+    }
+
+    *algorithmid = AlgorithmToId(checksum.substr(0, pos));
+    return true;
+}
+
 void LocalDb::StoreObject(const ObjectReference& ref, double age)
 {
     int rc;
@@ -258,24 +604,26 @@ void LocalDb::StoreObject(const ObjectReference& ref, double age)
     assert(ref.range_is_exact());
     int64_t size = ref.get_range_length();
 
+    int64_t algorithmid;
+    string digest;
+    if (!EncodeChecksum(checksum, &algorithmid, &digest))
+        fatal("Invalid block checksum: " + checksum);
+
+    int64_t segmentid = SegmentToId(ref.get_segment());
     if (age == 0.0) {
-        stmt = Prepare("insert into block_index("
-                       "segmentid, object, checksum, size, timestamp) "
-                       "values (?, ?, ?, ?, julianday('now'))");
+        stmt = Cached(STMT_STORE_OBJECT);
     } else {
-        stmt = Prepare("insert into block_index("
-                       "segmentid, object, checksum, size, timestamp) "
-                       "values (?, ?, ?, ?, ?)");
+        stmt = Cached(STMT_STORE_OBJECT_AGE);
     }
 
-    sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
+    sqlite3_bind_int64(stmt, 1, segmentid);
     string obj = ref.get_sequence();
     sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, checksum.c_str(), checksum.size(),
-                      SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 4, size);
+    sqlite3_bind_int64(stmt, 3, algorithmid);
+    sqlite3_bind_blob(stmt, 4, digest.data(), digest.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 5, size);
     if (age != 0.0)
-        sqlite3_bind_double(stmt, 5, age);
+        sqlite3_bind_double(stmt, 6, age);
 
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
@@ -283,7 +631,10 @@ void LocalDb::StoreObject(const ObjectReference& ref, double age)
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+
+    if (checksum_filter != NULL)
+        checksum_filter->add(digest);
 }
 
 ObjectReference LocalDb::FindObject(const string &checksum, int64_t size)
@@ -292,24 +643,30 @@ ObjectReference LocalDb::FindObject(const string &checksum, int64_t size)
     sqlite3_stmt *stmt;
     ObjectReference ref;
 
-    stmt = Prepare("select segmentid, object from block_index "
-                   "where checksum = ? and size = ? and expired is null");
-    sqlite3_bind_text(stmt, 1, checksum.c_str(), checksum.size(),
-                      SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, size);
+    int64_t algorithmid;
+    string digest;
+    if (!EncodeChecksum(checksum, &algorithmid, &digest)
+        || !MayContainChecksum(digest))
+        return ref;
+
+    stmt = Cached(STMT_FIND_OBJECT);
+    sqlite3_bind_blob(stmt, 1, digest.data(), digest.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, algorithmid);
+    sqlite3_bind_int64(stmt, 3, size);
 
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_DONE) {
     } else if (rc == SQLITE_ROW) {
-        ref = ObjectReference(IdToSegment(sqlite3_column_int64(stmt, 0)),
-                              (const char *)sqlite3_column_text(stmt, 1));
+        int64_t segmentid = sqlite3_column_int64(stmt, 0);
+        string object = (const char *)sqlite3_column_text(stmt, 1);
+        ref = ObjectReference(IdToSegment(segmentid), object);
         ref.set_range(0, size, true);
     } else {
         fprintf(stderr, "Could not execute SELECT statement!\n");
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     return ref;
 }
@@ -321,11 +678,16 @@ bool LocalDb::IsOldObject(const string &checksum, int64_t size, double *age,
     sqlite3_stmt *stmt;
     bool found = false;
 
-    stmt = Prepare("select segmentid, object, julianday(timestamp), expired "
-                   "from block_index where checksum = ? and size = ?");
-    sqlite3_bind_text(stmt, 1, checksum.c_str(), checksum.size(),
-                      SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 2, size);
+    int64_t algorithmid;
+    string digest;
+    if (!EncodeChecksum(checksum, &algorithmid, &digest)
+        || !MayContainChecksum(digest))
+        return false;
+
+    stmt = Cached(STMT_IS_OLD_OBJECT);
+    sqlite3_bind_blob(stmt, 1, digest.data(), digest.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, algorithmid);
+    sqlite3_bind_int64(stmt, 3, size);
 
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_DONE) {
@@ -339,7 +701,7 @@ bool LocalDb::IsOldObject(const string &checksum, int64_t size, double *age,
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     return found;
 }
@@ -356,9 +718,9 @@ bool LocalDb::IsAvailable(const ObjectReference &ref)
     if (!ref.is_normal())
         return true;
 
-    stmt = Prepare("select count(*) from block_index "
-                   "where segmentid = ? and object = ? and expired is null");
-    sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
+    int64_t segmentid = SegmentToId(ref.get_segment());
+    stmt = Cached(STMT_IS_AVAILABLE);
+    sqlite3_bind_int64(stmt, 1, segmentid);
     sqlite3_bind_text(stmt, 2, ref.get_sequence().c_str(),
                       ref.get_sequence().size(), SQLITE_TRANSIENT);
 
@@ -373,17 +735,128 @@ bool LocalDb::IsAvailable(const ObjectReference &ref)
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     return found;
 }
 
+/* Are all objects in this segment still available?  Segments are expired by
+ * the segment cleaner as a whole, so this gives the same answer as
+ * IsAvailable for each object in the segment, but only needs to query the
+ * database once per segment. */
+bool LocalDb::IsSegmentAvailable(const string &segment)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    bool available = false;
+
+    int64_t segmentid = SegmentToId(segment);
+    if (available_segments.count(segmentid))
+        return true;
+
+    stmt = Cached(STMT_SEGMENT_AVAILABLE);
+    sqlite3_bind_int64(stmt, 1, segmentid);
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        available = sqlite3_column_int64(stmt, 0) > 0
+            && sqlite3_column_int64(stmt, 1) == 0;
+    } else {
+        fprintf(stderr, "Could not execute SELECT statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_reset(stmt);
+
+    // Only a positive answer is remembered, since objects may yet be added.
+    if (available)
+        available_segments.insert(segmentid);
+    return available;
+}
+
+bool LocalDb::FindFile(const string &inode, int64_t size, int64_t *mtime,
+                       int64_t *recorded, string *checksum, string *blocks)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    bool found = false;
+
+    stmt = Cached(STMT_FIND_FILE);
+    sqlite3_bind_text(stmt, 1, inode.c_str(), inode.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, size);
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        found = false;
+    } else if (rc == SQLITE_ROW) {
+        found = true;
+        *mtime = sqlite3_column_int64(stmt, 0);
+        *checksum = (const char *)sqlite3_column_text(stmt, 1);
+        *blocks = (const char *)sqlite3_column_text(stmt, 2);
+        *recorded = sqlite3_column_int64(stmt, 3);
+    } else {
+        fprintf(stderr, "Could not execute SELECT statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_reset(stmt);
+
+    return found;
+}
+
+void LocalDb::StoreFile(const string &inode, int64_t size, int64_t mtime,
+                        const string &checksum, const string &blocks)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    stmt = Cached(STMT_STORE_FILE);
+    sqlite3_bind_text(stmt, 1, inode.c_str(), inode.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, size);
+    sqlite3_bind_int64(stmt, 3, mtime);
+    sqlite3_bind_text(stmt, 4, checksum.c_str(), checksum.size(),
+                      SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 5, blocks.c_str(), blocks.size(),
+                      SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 6, snapshotid);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not execute INSERT statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_reset(stmt);
+}
+
+void LocalDb::TouchFile(const string &inode, int64_t size, int64_t mtime)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    stmt = Cached(STMT_TOUCH_FILE);
+    sqlite3_bind_int64(stmt, 1, snapshotid);
+    sqlite3_bind_text(stmt, 2, inode.c_str(), inode.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 3, size);
+    sqlite3_bind_int64(stmt, 4, mtime);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not execute UPDATE statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_reset(stmt);
+}
+
 set<string> LocalDb::GetUsedSegments()
 {
     int rc;
     sqlite3_stmt *stmt;
     set<string> result;
 
+    FlushObjectRefs();
+
     stmt = Prepare("select segment from segments "
                    "where segmentid in (select segmentid from snapshot_refs)");
 
@@ -413,17 +886,27 @@ void LocalDb::UseObject(const ObjectReference& ref)
     if (!ref.is_normal())
         return;
 
-    int64_t old_size = 0;
-    stmt = Prepare("select size from snapshot_refs "
-                   "where segmentid = ? and object = ?");
-    sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
+    int64_t segmentid = SegmentToId(ref.get_segment());
     string obj = ref.get_sequence();
-    sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        old_size = sqlite3_column_int64(stmt, 0);
+
+    // Look up the bytes referenced so far: first in the pending updates, and
+    // then in snapshot_refs if anything has been flushed there already.
+    std::pair<int64_t, string> key(segmentid, obj);
+    map<std::pair<int64_t, string>, int64_t>::iterator pending
+        = pending_refs.find(key);
+    int64_t old_size = 0;
+    if (pending != pending_refs.end()) {
+        old_size = pending->second;
+    } else if (refs_flushed) {
+        stmt = Cached(STMT_SNAPSHOT_REFS_SIZE);
+        sqlite3_bind_int64(stmt, 1, segmentid);
+        sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            old_size = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_reset(stmt);
     }
-    sqlite3_finalize(stmt);
 
     // Attempt to determine the underlying size of the object.  This may
     // require a database lookup if the length is not encoded into the object
@@ -432,10 +915,8 @@ void LocalDb::UseObject(const ObjectReference& ref)
     if (ref.range_is_exact()) {
         object_size = ref.get_range_length();
     } else {
-        stmt = Prepare("select size from block_index "
-                       "where segmentid = ? and object = ?");
-        sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
-        obj = ref.get_sequence();
+        stmt = Cached(STMT_BLOCK_SIZE);
+        sqlite3_bind_int64(stmt, 1, segmentid);
         sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
         rc = sqlite3_step(stmt);
         if (rc == SQLITE_ROW) {
@@ -444,7 +925,7 @@ void LocalDb::UseObject(const ObjectReference& ref)
             fprintf(stderr, "Warning: No block found in block_index for %s\n",
                     ref.to_string().c_str());
         }
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
     }
 
     // Possibly mark additional bytes as being referenced.  The number of bytes
@@ -467,13 +948,30 @@ void LocalDb::UseObject(const ObjectReference& ref)
     new_size = max(new_size, (int64_t)0);
 
     if (new_size != old_size) {
-        stmt = Prepare("insert or replace "
-                       "into snapshot_refs(segmentid, object, size) "
-                       "values (?, ?, ?)");
-        sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
-        obj = ref.get_sequence();
+        if (pending != pending_refs.end())
+            pending->second = new_size;
+        else
+            pending_refs[key] = new_size;
+
+        if (pending_refs.size() >= MAX_PENDING_REFS)
+            FlushObjectRefs();
+    }
+}
+
+/* Write out the accumulated UseObject updates to the snapshot_refs table. */
+void LocalDb::FlushObjectRefs()
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    for (map<std::pair<int64_t, string>, int64_t>::const_iterator i
+            = pending_refs.begin(); i != pending_refs.end(); ++i) {
+        const string &obj = i->first.second;
+
+        stmt = Cached(STMT_SNAPSHOT_REFS_UPDATE);
+        sqlite3_bind_int64(stmt, 1, i->first.first);
         sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 3, new_size);
+        sqlite3_bind_int64(stmt, 3, i->second);
 
         rc = sqlite3_step(stmt);
         if (rc != SQLITE_DONE) {
@@ -481,8 +979,11 @@ void LocalDb::UseObject(const ObjectReference& ref)
             ReportError(rc);
         }
 
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
     }
+
+    pending_refs.clear();
+    refs_flushed = true;
 }
 
 void LocalDb::SetSegmentMetadata(const std::string &segment,
@@ -567,10 +1068,9 @@ bool LocalDb::LoadChunkSignatures(ObjectReference ref,
     sqlite3_stmt *stmt;
     int found = false;
 
-    stmt = Prepare("select signatures, algorithm from subblock_signatures "
-                   "where blockid = (select blockid from block_index "
-                   "                 where segmentid = ? and object = ?)");
-    sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
+    int64_t segmentid = SegmentToId(ref.get_segment());
+    stmt = Cached(STMT_LOAD_SIGNATURES);
+    sqlite3_bind_int64(stmt, 1, segmentid);
     string obj = ref.get_sequence();
     sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
 
@@ -593,7 +1093,7 @@ bool LocalDb::LoadChunkSignatures(ObjectReference ref,
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     return found;
 }
@@ -607,9 +1107,9 @@ void LocalDb::StoreChunkSignatures(ObjectReference ref,
     int rc;
     sqlite3_stmt *stmt;
 
-    stmt = Prepare("select blockid from block_index "
-                   "where segmentid = ? and object = ?");
-    sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
+    int64_t segmentid = SegmentToId(ref.get_segment());
+    stmt = Cached(STMT_BLOCK_ID);
+    sqlite3_bind_int64(stmt, 1, segmentid);
     string obj = ref.get_sequence();
     sqlite3_bind_text(stmt, 2, obj.c_str(), obj.size(), SQLITE_TRANSIENT);
 
@@ -621,11 +1121,9 @@ void LocalDb::StoreChunkSignatures(ObjectReference ref,
         fatal("Error getting blockid");
     }
     int64_t blockid = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
-    stmt = Prepare("insert or replace "
-                   "into subblock_signatures(blockid, algorithm, signatures) "
-                   "values (?, ?, ?)");
+    stmt = Cached(STMT_STORE_SIGNATURES);
     sqlite3_bind_int64(stmt, 1, blockid);
     sqlite3_bind_text(stmt, 2, algorithm.c_str(), algorithm.size(),
                       SQLITE_TRANSIENT);
@@ -637,5 +1135,5 @@ void LocalDb::StoreChunkSignatures(ObjectReference ref,
         ReportError(rc);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 }
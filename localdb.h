@@ -31,23 +31,43 @@
 
 #include <sqlite3.h>
 
+#include <map>
 #include <set>
 #include <string>
 
 #include "ref.h"
 
+class ChecksumFilter;
+
 class LocalDb {
 public:
+    /* If filter_size is non-zero, up to that many bytes of memory are used
+     * for an in-memory filter of the block checksums in the database, so
+     * that lookups of new data can usually be answered without a query. */
     void Open(const char *path, const char *snapshot_name,
-              const char *snapshot_scheme);
+              const char *snapshot_scheme, size_t filter_size = 0);
     void Close();
+    void DumpStats();
     void StoreObject(const ObjectReference& ref, double age);
     ObjectReference FindObject(const std::string &checksum, int64_t size);
     bool IsOldObject(const std::string &checksum, int64_t size, double *age,
                      int *group);
     bool IsAvailable(const ObjectReference &ref);
+    bool IsSegmentAvailable(const std::string &segment);
     void UseObject(const ObjectReference& ref);
 
+    /* The file index, keyed by inode (as formatted in the metadata log); see
+     * schema.sql for the format of blocks.  FindFile also returns the time (in
+     * seconds since the epoch) at which the snapshot that last included the
+     * file was started.  TouchFile records that an indexed file, unchanged,
+     * is part of this snapshot. */
+    bool FindFile(const std::string &inode, int64_t size, int64_t *mtime,
+                  int64_t *recorded, std::string *checksum,
+                  std::string *blocks);
+    void StoreFile(const std::string &inode, int64_t size, int64_t mtime,
+                   const std::string &checksum, const std::string &blocks);
+    void TouchFile(const std::string &inode, int64_t size, int64_t mtime);
+
     std::set<std::string> GetUsedSegments();
     void SetSegmentMetadata(const std::string &segment, const std::string &path,
                             const std::string &checksum,
@@ -66,10 +86,68 @@ private:
     sqlite3 *db;
     int64_t snapshotid;
 
+    /* Statements executed for each block are prepared once in Open() and kept
+     * for reuse until Close(), rather than being compiled on every call. */
+    enum CachedStatement {
+        STMT_SEGMENT_INSERT,
+        STMT_SEGMENT_TO_ID,
+        STMT_ID_TO_SEGMENT,
+        STMT_ALGORITHM_INSERT,
+        STMT_ALGORITHM_TO_ID,
+        STMT_STORE_OBJECT,
+        STMT_STORE_OBJECT_AGE,
+        STMT_FIND_OBJECT,
+        STMT_IS_OLD_OBJECT,
+        STMT_IS_AVAILABLE,
+        STMT_SNAPSHOT_REFS_SIZE,
+        STMT_BLOCK_SIZE,
+        STMT_SNAPSHOT_REFS_UPDATE,
+        STMT_LOAD_SIGNATURES,
+        STMT_BLOCK_ID,
+        STMT_STORE_SIGNATURES,
+        STMT_SEGMENT_AVAILABLE,
+        STMT_FIND_FILE,
+        STMT_STORE_FILE,
+        STMT_TOUCH_FILE,
+        NUM_CACHED_STATEMENTS
+    };
+    static const char *const cached_statement_sql[NUM_CACHED_STATEMENTS];
+    sqlite3_stmt *cached_statements[NUM_CACHED_STATEMENTS];
+
     sqlite3_stmt *Prepare(const char *sql);
+    sqlite3_stmt *Cached(CachedStatement which);
     void ReportError(int rc);
     int64_t SegmentToId(const std::string &segment);
     std::string IdToSegment(int64_t segmentid);
+    int64_t AlgorithmToId(const std::string &algorithm);
+    bool EncodeChecksum(const std::string &checksum, int64_t *algorithmid,
+                        std::string *digest);
+
+    /* Two-way cache of the segments table.  Entries are filled in as segments
+     * are looked up, and new segments are added to both the database and the
+     * cache, so repeated lookups never need to go to the database. */
+    std::map<std::string, int64_t> segment_ids;
+    std::map<int64_t, std::string> segment_names;
+
+    // Likewise for checksum_algorithms, in one direction only.
+    std::map<std::string, int64_t> algorithm_ids;
+
+    // Segments known to have no expired objects.  Segments are expired as a
+    // whole, so this answers IsSegmentAvailable for any object in them.
+    std::set<int64_t> available_segments;
+
+    /* Bytes referenced in each object by this snapshot, as updated by
+     * UseObject but not yet written to the snapshot_refs table.  Updates are
+     * written out in bulk at Close(), or earlier if too many accumulate. */
+    static const size_t MAX_PENDING_REFS = 1 << 18;
+    std::map<std::pair<int64_t, std::string>, int64_t> pending_refs;
+    bool refs_flushed;
+    void FlushObjectRefs();
+
+    ChecksumFilter *checksum_filter;
+    int64_t filter_lookups, filter_misses;
+    void LoadChecksumFilter(size_t filter_size);
+    bool MayContainChecksum(const std::string &digest);
 };
 
 #endif // _LBS_LOCALDB_H
@@ -25,11 +25,13 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
@@ -46,11 +48,14 @@
 #include <string>
 #include <vector>
 
+#include "chunker.h"
+#include "compress.h"
 #include "cumulus.h"
 #include "exclude.h"
 #include "hash.h"
 #include "localdb.h"
 #include "metadata.h"
+#include "reader.h"
 #include "remote.h"
 #include "store.h"
 #include "subfile.h"
@@ -59,6 +64,8 @@
 
 using std::list;
 using std::map;
+using std::min;
+using std::pair;
 using std::string;
 using std::vector;
 using std::ostream;
@@ -75,10 +82,13 @@ static RemoteStore *remote = NULL;
 static TarSegmentStore *tss = NULL;
 static MetadataWriter *metawriter = NULL;
 
-/* Buffer for holding a single block of data read from a file. */
-static const size_t LBS_BLOCK_SIZE = 1024 * 1024;
+/* Buffer for holding a single block of data read from a file.  Used only by
+ * the scanning thread, for reading filter merge files. */
 static char *block_buf;
 
+/* Worker threads for reading and checksumming file data, if any. */
+static ReaderPool *reader_pool = NULL;
+
 /* Local database, which tracks objects written in this and previous
  * invocations to help in creating incremental snapshots. */
 LocalDb *db;
@@ -92,8 +102,10 @@ bool flag_rebuild_statcache = false;
 bool verbose = false;
 
 /* Attempts to open a regular file read-only, but with safety checks for files
- * that might not be fully trusted. */
-int safe_open(const string& path, struct stat *stat_buf)
+ * that might not be fully trusted.  The file is opened by name relative to the
+ * directory dirfd (which may be AT_FDCWD); path is used only for messages. */
+int safe_openat(int dirfd, const string& name, const string& path,
+                struct stat *stat_buf)
 {
     int fd;
 
@@ -109,9 +121,10 @@ int safe_open(const string& path, struct stat *stat_buf)
      * We also add in O_NOATIME, since this may reduce disk writes (for
      * inode updates).  However, O_NOATIME may result in EPERM, so if the
      * initial open fails, try again without O_NOATIME.  */
-    fd = open(path.c_str(), O_RDONLY|O_NOATIME|O_NOFOLLOW|O_NONBLOCK);
+    fd = openat(dirfd, name.c_str(),
+                O_RDONLY|O_NOATIME|O_NOFOLLOW|O_NONBLOCK);
     if (fd < 0) {
-        fd = open(path.c_str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+        fd = openat(dirfd, name.c_str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
     }
     if (fd < 0) {
         fprintf(stderr, "Unable to open file %s: %m\n", path.c_str());
@@ -146,36 +159,126 @@ int safe_open(const string& path, struct stat *stat_buf)
     return fd;
 }
 
-/* Read data from a file descriptor and return the amount of data read.  A
- * short read (less than the requested size) will only occur if end-of-file is
- * hit. */
-ssize_t file_read(int fd, char *buf, size_t maxlen)
+/* Files with more than one hard link which have already been dumped in this
+ * snapshot, so that when another link to the same file is found its contents
+ * need not be read again.  An entry is dropped once all links have been seen,
+ * or if the file appears to have changed. */
+struct HardLink {
+    time_t ctime, mtime;
+    off_t size;
+    nlink_t links_remaining;    // Links not yet seen
+    string checksum;
+    list<string> object_list;
+};
+
+static map<pair<dev_t, ino_t>, HardLink> hard_links;
+
+static bool same_file(const HardLink& link, const struct stat& stat_buf)
 {
-    size_t bytes_read = 0;
+    return link.ctime == stat_buf.st_ctime
+        && link.mtime == stat_buf.st_mtime
+        && link.size == stat_buf.st_size;
+}
 
-    while (true) {
-        ssize_t res = read(fd, buf, maxlen);
-        if (res < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "error reading file: %m\n");
-            return -1;
-        } else if (res == 0) {
-            break;
-        } else {
-            bytes_read += res;
-            buf += res;
-            maxlen -= res;
+/* Record the results of dumping a file with several links.  This is also
+ * called for links which did not use an earlier result (as when the file was
+ * unchanged in the old statcache), which only count towards the links seen. */
+static void remember_hard_link(const struct stat& stat_buf,
+                               const string& checksum,
+                               const list<string>& object_list)
+{
+    pair<dev_t, ino_t> key(stat_buf.st_dev, stat_buf.st_ino);
+    map<pair<dev_t, ino_t>, HardLink>::iterator i = hard_links.find(key);
+    if (i != hard_links.end() && same_file(i->second, stat_buf)) {
+        if (--i->second.links_remaining == 0)
+            hard_links.erase(i);
+        return;
+    }
+
+    HardLink &link = hard_links[key];
+    link.ctime = stat_buf.st_ctime;
+    link.mtime = stat_buf.st_mtime;
+    link.size = stat_buf.st_size;
+    link.links_remaining = stat_buf.st_nlink - 1;
+    link.checksum = checksum;
+    link.object_list = object_list;
+}
+
+/* Look up the results for an earlier link to the same file, returning true
+ * and filling in checksum and object_list if they can be used. */
+static bool find_hard_link(const struct stat& stat_buf, string *checksum,
+                           list<string> *object_list)
+{
+    pair<dev_t, ino_t> key(stat_buf.st_dev, stat_buf.st_ino);
+    map<pair<dev_t, ino_t>, HardLink>::iterator i = hard_links.find(key);
+    if (i == hard_links.end())
+        return false;
+
+    const HardLink &link = i->second;
+    bool unchanged = same_file(link, stat_buf);
+    if (unchanged) {
+        *checksum = link.checksum;
+        *object_list = link.object_list;
+    }
+
+    if (!unchanged || --i->second.links_remaining == 0)
+        hard_links.erase(i);
+    return unchanged;
+}
+
+/* Files of at least this size are recorded in the file index of the local
+ * database (see schema.sql). */
+static const off_t FILE_INDEX_MIN_SIZE = LBS_BLOCK_SIZE;
+
+/* A file changed within this many seconds of being read is marked volatile:
+ * it may still be being written, so neither the statcache nor the file index
+ * trust its modification time to mean the contents are unchanged. */
+static const time_t VOLATILE_WINDOW = 30;
+
+/* One block of a file, as listed in the file index. */
+struct IndexedBlock {
+    string checksum;            // Block checksum, or "zero"
+    list<string> refs;
+};
+
+/* Look up a file in the file index, returning its blocks only if all of the
+ * objects they refer to are still available.  *recorded is set to the time of
+ * the snapshot which last included the file. */
+static bool find_indexed_file(const string& inode, const struct stat& stat_buf,
+                              int64_t *mtime, int64_t *recorded,
+                              string *checksum, vector<IndexedBlock> *blocks)
+{
+    string text;
+    if (!db->FindFile(inode, stat_buf.st_size, mtime, recorded, checksum,
+                      &text))
+        return false;
+
+    std::istringstream lines(text);
+    string line;
+    while (getline(lines, line)) {
+        std::istringstream fields(line);
+        IndexedBlock block;
+        string ref;
+        fields >> block.checksum;
+        while (fields >> ref) {
+            ObjectReference parsed = ObjectReference::parse(ref);
+            if (parsed.is_null())
+                return false;
+            if (parsed.is_normal()
+                && !db->IsSegmentAvailable(parsed.get_segment()))
+                return false;
+            block.refs.push_back(ref);
         }
+        blocks->push_back(block);
     }
 
-    return bytes_read;
+    return true;
 }
 
-/* Read the contents of a file (specified by an open file descriptor) and copy
+/* Read the contents of a file (through the FileReader opened on it) and copy
  * the data to the store.  Returns the size of the file (number of bytes
  * dumped), or -1 on error. */
-int64_t dumpfile(int fd, dictionary &file_info, const string &path,
+int64_t dumpfile(FileReader *reader, dictionary &file_info, const string &path,
                  struct stat& stat_buf)
 {
     int64_t size = 0;
@@ -213,6 +316,7 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
 
         /* If everything looks okay, use the cached information */
         if (cached) {
+            reader->cancel();
             file_info["checksum"] = metawriter->get_checksum();
             for (list<ObjectReference>::const_iterator i = old_blocks.begin();
                  i != old_blocks.end(); ++i) {
@@ -224,45 +328,105 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
         }
     }
 
+    /* Another link to a file already dumped in this snapshot can reuse the
+     * results from then, without reading the file at all.  The objects were
+     * already marked as used in this snapshot at that time. */
+    bool linked = false;
+    if (!cached && stat_buf.st_nlink > 1 && !flag_rebuild_statcache) {
+        string checksum;
+        if (find_hard_link(stat_buf, &checksum, &object_list)) {
+            cached = linked = true;
+            reader->cancel();
+            file_info["checksum"] = checksum;
+            size = stat_buf.st_size;
+            status = NULL;
+        }
+    }
+
+    /* Larger files are also looked up by inode in the file index.  If the
+     * modification time matches, the file has only been moved or renamed and
+     * need not be read.  Otherwise the blocks listed are compared against the
+     * data as it is read, and any that match are used without looking them up
+     * in the database.  As with the statcache, the modification time is not
+     * trusted if the file was modified within VOLATILE_WINDOW of being
+     * recorded, and volatile files are not recorded at all. */
+    const string &inode = file_info["inode"];
+    bool indexed = stat_buf.st_size >= FILE_INDEX_MIN_SIZE
+        && !flag_rebuild_statcache;
+    bool is_volatile = file_info.find("volatile") != file_info.end();
+    vector<IndexedBlock> indexed_blocks;
+    if (!cached && indexed) {
+        int64_t mtime, recorded;
+        string checksum;
+        if (find_indexed_file(inode, stat_buf, &mtime, &recorded, &checksum,
+                              &indexed_blocks)
+            && mtime == stat_buf.st_mtime && !is_volatile
+            && recorded - mtime >= VOLATILE_WINDOW) {
+            cached = true;
+            reader->cancel();
+            file_info["checksum"] = checksum;
+            for (size_t i = 0; i < indexed_blocks.size(); i++) {
+                const list<string> &refs = indexed_blocks[i].refs;
+                for (list<string>::const_iterator j = refs.begin();
+                     j != refs.end(); ++j) {
+                    object_list.push_back(*j);
+                    db->UseObject(ObjectReference::parse(*j));
+                }
+            }
+            size = stat_buf.st_size;
+            status = NULL;
+        }
+    }
+
     /* If the file is new or changed, we must read in the contents a block at a
-     * time. */
+     * time.  The reader may already have read and checksummed the data in
+     * another thread.  For larger files, the checksum and references for each
+     * block are collected for the file index. */
     if (!cached) {
-        scoped_ptr<Hash> file_hash(Hash::New());
         Subfile subfile(db);
         subfile.load_old_blocks(old_blocks);
+        size_t block_number = 0;
+        string index_blocks;
 
         while (true) {
-            ssize_t bytes = file_read(fd, block_buf, LBS_BLOCK_SIZE);
-            if (bytes == 0)
+            ReadBlock *block = reader->next_block();
+            if (block == NULL)
                 break;
-            if (bytes < 0) {
-                fprintf(stderr, "Backup contents for %s may be incorrect\n",
-                        path.c_str());
-                break;
-            }
 
-            file_hash->update(block_buf, bytes);
-
-            // Sparse file processing: if we read a block of all zeroes, encode
-            // that explicitly.
-            bool all_zero = true;
-            for (int i = 0; i < bytes; i++) {
-                if (block_buf[i] != 0) {
-                    all_zero = false;
-                    break;
+            ssize_t bytes = block->len;
+            const string &block_csum = block->checksum;
+
+            if (indexed)
+                index_blocks += block->all_zero ? "zero" : block_csum;
+
+            // The same data as in this block of the file when it was indexed
+            // can use the same objects.
+            if (block_number < indexed_blocks.size() && !block->all_zero
+                && indexed_blocks[block_number].checksum == block_csum) {
+                const list<string> &refs = indexed_blocks[block_number].refs;
+                for (list<string>::const_iterator i = refs.begin();
+                     i != refs.end(); ++i) {
+                    object_list.push_back(*i);
+                    db->UseObject(ObjectReference::parse(*i));
+                    index_blocks += " " + *i;
                 }
+                index_blocks += "\n";
+
+                reader->release_block(block);
+                block_number++;
+                size += bytes;
+                if (status == NULL)
+                    status = "old";
+                continue;
             }
+            block_number++;
 
             // Either find a copy of this block in an already-existing segment,
             // or index it so it can be re-used in the future
             double block_age = 0.0;
             ObjectReference ref;
 
-            scoped_ptr<Hash> block_hash(Hash::New());
-            block_hash->update(block_buf, bytes);
-            string block_csum = block_hash->digest_str();
-
-            if (all_zero) {
+            if (block->all_zero) {
                 ref = ObjectReference(ObjectReference::REF_ZERO);
                 ref.set_range(0, bytes);
             } else {
@@ -302,28 +466,49 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
                     status = "new";
                 }
 
-                subfile.analyze_new_block(block_buf, bytes);
+                subfile.set_new_block(block->data, bytes, block->chunks,
+                                      block_csum);
                 refs = subfile.create_incremental(tss, o, block_age);
             } else {
                 if (flag_rebuild_statcache && ref.is_normal()) {
-                    subfile.analyze_new_block(block_buf, bytes);
+                    subfile.set_new_block(block->data, bytes, block->chunks,
+                                          block_csum);
                     subfile.store_analyzed_signatures(ref);
                 }
                 refs.push_back(ref);
             }
 
+            reader->release_block(block);
+
             while (!refs.empty()) {
                 ref = refs.front(); refs.pop_front();
-                object_list.push_back(ref.to_string());
+                string ref_str = ref.to_string();
+                object_list.push_back(ref_str);
                 db->UseObject(ref);
+                if (indexed)
+                    index_blocks += " " + ref_str;
             }
+            if (indexed)
+                index_blocks += "\n";
             size += bytes;
 
             if (status == NULL)
                 status = "old";
         }
 
-        file_info["checksum"] = file_hash->digest_str();
+        if (reader->read_error()) {
+            fprintf(stderr, "Backup contents for %s may be incorrect\n",
+                    path.c_str());
+        }
+
+        file_info["checksum"] = reader->checksum();
+
+        if (indexed && !is_volatile && !reader->read_error()
+            && size == stat_buf.st_size)
+            db->StoreFile(inode, size, stat_buf.st_mtime,
+                          file_info["checksum"], index_blocks);
+    } else if (indexed && !is_volatile) {
+        db->TouchFile(inode, stat_buf.st_size, stat_buf.st_mtime);
     }
 
     // Sanity check: if we are rebuilding the statcache, but the file looks
@@ -344,6 +529,10 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
         }
     }
 
+    if (stat_buf.st_nlink > 1 && !linked && size == stat_buf.st_size
+        && !reader->read_error())
+        remember_hard_link(stat_buf, file_info["checksum"], object_list);
+
     if (verbose && status != NULL)
         printf("    [%s]\n", status);
 
@@ -393,12 +582,12 @@ string group_to_string(gid_t gid) {
 }
 
 /* Dump a specified filesystem object (file, directory, etc.) based on its
- * inode information.  If the object is a regular file, an open filehandle is
- * provided. */
+ * inode information.  If the object is a regular file, a reader for the file
+ * contents is provided. */
 void dump_inode(const string& path,         // Path within snapshot
                 const string& fullpath,     // Path to object in filesystem
                 struct stat& stat_buf,      // Results of stat() call
-                int fd)                     // Open filehandle if regular file
+                FileReader *reader)         // File reader if regular file
 {
     char *buf;
     dictionary file_info;
@@ -417,7 +606,8 @@ void dump_inode(const string& path,         // Path within snapshot
     file_info["group"] = group_to_string(stat_buf.st_gid);
 
     time_t now = time(NULL);
-    if (now - stat_buf.st_ctime < 30 || now - stat_buf.st_mtime < 30)
+    if (now - stat_buf.st_ctime < VOLATILE_WINDOW
+        || now - stat_buf.st_mtime < VOLATILE_WINDOW)
         if ((stat_buf.st_mode & S_IFMT) != S_IFDIR)
             file_info["volatile"] = "1";
 
@@ -466,7 +656,7 @@ void dump_inode(const string& path,         // Path within snapshot
     case S_IFREG:
         inode_type = 'f';
 
-        file_size = dumpfile(fd, file_info, path, stat_buf);
+        file_size = dumpfile(reader, file_info, path, stat_buf);
         file_info["size"] = encode_int(file_size);
 
         if (file_size < 0)
@@ -506,14 +696,15 @@ string metafile_path(const string& path)
     return newpath;
 }
 
-void try_merge_filter(const string& path, const string& basedir)
+void try_merge_filter(int dirfd, const string& name, const string& path,
+                      const string& basedir)
 {
     struct stat stat_buf;
-    if (lstat(path.c_str(), &stat_buf) < 0)
+    if (fstatat(dirfd, name.c_str(), &stat_buf, AT_SYMLINK_NOFOLLOW) < 0)
         return;
     if ((stat_buf.st_mode & S_IFMT) != S_IFREG)
         return;
-    int fd = safe_open(path, NULL);
+    int fd = safe_openat(dirfd, name, path, NULL);
     if (fd < 0)
         return;
 
@@ -532,99 +723,419 @@ void try_merge_filter(const string& path, const string& basedir)
                                 string(block_buf, bytes));
 }
 
-void scanfile(const string& path)
+/* The file system is scanned in a separate thread from the one writing out
+ * the backup, so that file contents can be read ahead.  Each object to be
+ * dumped is passed as a ScanEntry through a ScanQueue, in sorted order (which
+ * is the order needed for the metadata log and statcache). */
+struct ScanEntry {
+    string path;                // Path within snapshot
+    string fullpath;            // Path to object in filesystem
+    struct stat stat_buf;       // Results of stat() call
+    FileReader *reader;         // File reader if opened by the scanner
+};
+
+class ScanQueue {
+public:
+    /* Bound on queued entries.  This also limits the number of regular files
+     * held open at once. */
+    static const size_t MAX_QUEUE_SIZE = 256;
+
+    ScanQueue() : closed(false), open_files(0) {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+    ~ScanQueue() {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    void push(ScanEntry *entry) {
+        pthread_mutex_lock(&lock);
+        while (entries.size() >= MAX_QUEUE_SIZE)
+            pthread_cond_wait(&cond, &lock);
+        entries.push_back(entry);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* Returns the next entry, or NULL once the queue has been closed and all
+     * entries consumed. */
+    ScanEntry *pop() {
+        pthread_mutex_lock(&lock);
+        while (entries.empty() && !closed)
+            pthread_cond_wait(&cond, &lock);
+        ScanEntry *entry = NULL;
+        if (!entries.empty()) {
+            entry = entries.front();
+            entries.pop_front();
+            pthread_cond_broadcast(&cond);
+        }
+        pthread_mutex_unlock(&lock);
+        return entry;
+    }
+
+    void close() {
+        pthread_mutex_lock(&lock);
+        closed = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* Count the regular files opened by the scanning thread and not yet
+     * dumped.  reserve_file returns false if limit files are open already, in
+     * which case the file should be left to be opened when it is dumped. */
+    bool reserve_file(size_t limit) {
+        pthread_mutex_lock(&lock);
+        bool result = open_files < limit;
+        if (result)
+            open_files++;
+        pthread_mutex_unlock(&lock);
+        return result;
+    }
+    void release_file() {
+        pthread_mutex_lock(&lock);
+        open_files--;
+        pthread_mutex_unlock(&lock);
+    }
+
+private:
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool closed;
+    list<ScanEntry *> entries;
+    size_t open_files;
+};
+
+static ScanQueue scan_queue;
+
+/* A separate reader on the old statcache, used by the scanning thread to guess
+ * which files dumpfile() will need to read so that reading can be started
+ * early.  It applies the same test as dumpfile(); a wrong guess costs time
+ * (the file is read in the main thread instead) but does not affect the
+ * backup produced. */
+static StatcacheReader *scan_statcache = NULL;
+
+/* Links seen by the scanning thread to files with more than one link, with the
+ * number of links still to be seen.  Only the first link found to such a file
+ * needs to be read; dumpfile() reuses the results for the rest. */
+static map<pair<dev_t, ino_t>, nlink_t> scan_links;
+
+static bool will_read(const string& path, const struct stat *stat_buf)
+{
+    if (flag_rebuild_statcache)
+        return true;
+    if (scan_statcache->find(path) && scan_statcache->is_unchanged(stat_buf))
+        return false;
+
+    if (stat_buf->st_nlink > 1) {
+        pair<dev_t, ino_t> key(stat_buf->st_dev, stat_buf->st_ino);
+        map<pair<dev_t, ino_t>, nlink_t>::iterator i = scan_links.find(key);
+        if (i == scan_links.end()) {
+            scan_links[key] = stat_buf->st_nlink - 1;
+        } else {
+            if (--i->second == 0)
+                scan_links.erase(i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Limit on the number of files in a directory which are opened together so
+ * that they can be read in order of their location on disk. */
+static const size_t READ_ORDER_WINDOW = 64;
+
+/* Limits on the file descriptors held by the scanning thread: directories
+ * being scanned (one for each level of the tree, up to this depth) and
+ * regular files opened to be read ahead.  These are lowered in main() to fit
+ * the process limit on open files, leaving the rest for the segment store,
+ * the database, and files being dumped.  Beyond them, directories are closed
+ * and their contents looked up by full path, and files are opened only when
+ * dumped. */
+static const size_t MAX_OPEN_DIR_LEVELS = 16;
+static size_t max_open_dir_levels = MAX_OPEN_DIR_LEVELS;
+static size_t max_open_files = ScanQueue::MAX_QUEUE_SIZE + READ_ORDER_WINDOW;
+static size_t open_dir_levels = 0;
+
+/* Sort key for the order in which files are read.  Only files of at most one
+ * block are reordered: a worker reads one of these completely without waiting
+ * for the consumer, so the pool can get through a whole window of them ahead
+ * of the consumer.  These go first, by location on disk where the file system
+ * reports it, and otherwise by inode number, which on most file systems is
+ * correlated with location.  Larger files follow in name order, the order in
+ * which the consumer needs them. */
+struct ReadOrder {
+    bool small;
+    bool physical;
+    uint64_t key;
+    FileReader *reader;
+
+    bool operator<(const ReadOrder& other) const {
+        if (small != other.small)
+            return small;
+        if (!small)
+            return false;
+        if (physical != other.physical)
+            return physical;
+        return key < other.key;
+    }
+};
+
+/* Hand the readers for a group of files to the reader pool, ordered to reduce
+ * seeking.  The ScanEntry objects are still queued in name order, as needed
+ * for the metadata log; the reader pool does not require the two orders to
+ * match. */
+static void submit_reads(const vector<FileReader *>& readers,
+                         const vector<ScanEntry *>& entries)
+{
+    vector<ReadOrder> order(readers.size());
+    for (size_t i = 0; i < readers.size(); i++) {
+        order[i].reader = readers[i];
+        order[i].small
+            = entries[i]->stat_buf.st_size <= (off_t)LBS_BLOCK_SIZE;
+        order[i].physical = order[i].small && readers.size() > 1
+            && readers[i]->physical_offset(&order[i].key);
+        if (!order[i].physical)
+            order[i].key = entries[i]->stat_buf.st_ino;
+    }
+
+    stable_sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++)
+        reader_pool->submit(order[i].reader);
+}
+
+/* Look up the file at path, which is found as name in the directory dirfd,
+ * and prepare the entry for it if it is to be included in the backup.  The
+ * directory is scanned by file descriptor rather than by full path, so that
+ * the kernel need not look up every component of the path again for each
+ * file.  When known, d_type is the file type from the directory entry; with
+ * it the filter rules can be applied before the file is stat'ed, so that
+ * excluded files are never stat'ed at all.
+ *
+ * Regular files which the reader pool should read ahead are opened here, and
+ * *submit is set.  Others are only opened when dumped, so that files which
+ * turn out to be unchanged do not hold a descriptor while queued. */
+static ScanEntry *stat_entry(const string& path, int dirfd, const string& name,
+                             unsigned char d_type, bool *submit)
 {
-    int fd = -1;
     struct stat stat_buf;
-    list<string> refs;
 
     string output_path = metafile_path(path);
 
-    if (lstat(path.c_str(), &stat_buf) < 0) {
+    if (d_type != DT_UNKNOWN
+        && !filter_rules.is_included(output_path, d_type == DT_DIR))
+        return NULL;
+
+    if (fstatat(dirfd, name.c_str(), &stat_buf, AT_SYMLINK_NOFOLLOW) < 0) {
         fprintf(stderr, "lstat(%s): %m\n", path.c_str());
-        return;
+        return NULL;
     }
 
+    /* Check the filter rules now if this was not possible before, or if the
+     * file was replaced by one of a different type in between. */
     bool is_directory = ((stat_buf.st_mode & S_IFMT) == S_IFDIR);
-    if (!filter_rules.is_included(output_path, is_directory))
-        return;
-
-    if ((stat_buf.st_mode & S_IFMT) == S_IFREG) {
-        fd = safe_open(path, &stat_buf);
-        if (fd < 0)
-            return;
+    if ((d_type == DT_UNKNOWN || is_directory != (d_type == DT_DIR))
+        && !filter_rules.is_included(output_path, is_directory))
+        return NULL;
+
+    FileReader *reader = NULL;
+    *submit = false;
+    if ((stat_buf.st_mode & S_IFMT) == S_IFREG && reader_pool != NULL
+        && will_read(output_path, &stat_buf)
+        && scan_queue.reserve_file(max_open_files)) {
+        int fd = safe_openat(dirfd, name, path, &stat_buf);
+        if (fd < 0) {
+            scan_queue.release_file();
+            return NULL;
+        }
+        reader = new FileReader(fd, stat_buf);
+        *submit = true;
     }
 
-    dump_inode(output_path, path, stat_buf, fd);
+    ScanEntry *entry = new ScanEntry;
+    entry->path = output_path;
+    entry->fullpath = path;
+    entry->stat_buf = stat_buf;
+    entry->reader = reader;
+    return entry;
+}
 
-    if (fd >= 0)
-        close(fd);
+static bool scan_directory(const string& path, int dirfd, const string& name,
+                           const string& output_path);
+
+/* Scan the file system starting from path, which is found as name in the
+ * directory dirfd. */
+void scanfile(const string& path, int dirfd, const string& name,
+              unsigned char d_type)
+{
+    bool submit;
+    ScanEntry *entry = stat_entry(path, dirfd, name, d_type, &submit);
+    if (entry == NULL)
+        return;
+
+    if (submit)
+        reader_pool->submit(entry->reader);
+
+    /* The entry belongs to the consumer once queued. */
+    bool is_directory = (entry->stat_buf.st_mode & S_IFMT) == S_IFDIR;
+    string output_path = entry->path;
+    scan_queue.push(entry);
 
     /* If we hit a directory, now that we've written the directory itself,
      * recursively scan the directory. */
-    if (is_directory) {
-        DIR *dir = opendir(path.c_str());
+    if (is_directory)
+        scan_directory(path, dirfd, name, output_path);
+}
 
-        if (dir == NULL) {
-            fprintf(stderr, "Error reading directory %s: %m\n",
-                    path.c_str());
-            return;
-        }
+/* Scan the contents of a directory, which has already been queued itself.
+ * The directory is normally held open until its contents have been scanned,
+ * but is closed before descending into a subdirectory if too many levels are
+ * open already, after which the remaining items are looked up by full path.
+ *
+ * Returns false, without reporting an error, if the directory could not be
+ * opened relative to dirfd for lack of file descriptors; the caller can then
+ * close its own directory and try again. */
+static bool scan_directory(const string& path, int dirfd, const string& name,
+                           const string& output_path)
+{
+    int fd = openat(dirfd, name.c_str(),
+                    O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0 && errno == EMFILE && dirfd != AT_FDCWD)
+        return false;
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+
+    if (dir == NULL) {
+        fprintf(stderr, "Error reading directory %s: %m\n", path.c_str());
+        if (fd >= 0)
+            close(fd);
+        return true;
+    }
+    open_dir_levels++;
+
+    struct dirent *ent;
+    vector<pair<string, unsigned char> > contents;
+    while ((ent = readdir(dir)) != NULL) {
+        string filename(ent->d_name);
+        if (filename == "." || filename == "..")
+            continue;
+        contents.push_back(make_pair(filename, ent->d_type));
+    }
 
-        struct dirent *ent;
-        vector<string> contents;
-        while ((ent = readdir(dir)) != NULL) {
-            string filename(ent->d_name);
-            if (filename == "." || filename == "..")
-                continue;
-            contents.push_back(filename);
+    sort(contents.begin(), contents.end());
+
+    filter_rules.save();
+
+    /* Build the paths of directory items from the directory path. */
+    string prefix;
+    if (path == "/")
+        prefix = "/";
+    else if (path != ".")
+        prefix = path + "/";
+
+    /* First pass through the directory items: look for any filter rules to
+     * merge and do so. */
+    for (vector<pair<string, unsigned char> >::iterator i = contents.begin();
+         i != contents.end(); ++i) {
+        string filename = prefix + i->first;
+        if (filter_rules.is_mergefile(metafile_path(filename))) {
+            if (verbose) {
+                printf("Merging directory filter rules %s\n",
+                       filename.c_str());
+            }
+            try_merge_filter(fd, i->first, filename, output_path);
         }
+    }
 
-        closedir(dir);
+    /* Second pass: scan all items in the directory for backup, a window of
+     * them at a time.  The files in each window which need to be read are
+     * submitted to the reader pool in disk order, then the entries are queued
+     * in name order.  A subdirectory ends the window, so that files are not
+     * held open while it is scanned recursively. */
+    size_t next = 0;
+    while (next < contents.size()) {
+        vector<ScanEntry *> window;
+        vector<size_t> names;
+        vector<FileReader *> readers;
+        vector<ScanEntry *> reader_entries;
+
+        while (next < contents.size() && window.size() < READ_ORDER_WINDOW) {
+            const pair<string, unsigned char>& item = contents[next++];
+            string item_path = prefix + item.first;
+            bool submit;
+            ScanEntry *entry = stat_entry(item_path, fd,
+                                          dir != NULL ? item.first : item_path,
+                                          item.second, &submit);
+            if (entry == NULL)
+                continue;
 
-        sort(contents.begin(), contents.end());
-
-        filter_rules.save();
-
-        /* First pass through the directory items: look for any filter rules to
-         * merge and do so. */
-        for (vector<string>::iterator i = contents.begin();
-             i != contents.end(); ++i) {
-            string filename;
-            if (path == ".")
-                filename = *i;
-            else if (path == "/")
-                filename = "/" + *i;
-            else
-                filename = path + "/" + *i;
-            if (filter_rules.is_mergefile(metafile_path(filename))) {
-                if (verbose) {
-                    printf("Merging directory filter rules %s\n",
-                           filename.c_str());
-                }
-                try_merge_filter(filename, output_path);
+            window.push_back(entry);
+            names.push_back(next - 1);
+            if (submit) {
+                readers.push_back(entry->reader);
+                reader_entries.push_back(entry);
             }
+            if ((entry->stat_buf.st_mode & S_IFMT) == S_IFDIR)
+                break;
         }
 
-        /* Second pass: recursively scan all items in the directory for backup;
-         * scanfile() will check if the item should be included or not. */
-        for (vector<string>::iterator i = contents.begin();
-             i != contents.end(); ++i) {
-            const string& filename = *i;
-            if (path == ".")
-                scanfile(filename);
-            else if (path == "/")
-                scanfile("/" + filename);
-            else
-                scanfile(path + "/" + filename);
+        submit_reads(readers, reader_entries);
+
+        for (size_t i = 0; i < window.size(); i++) {
+            ScanEntry *entry = window[i];
+            bool is_directory = (entry->stat_buf.st_mode & S_IFMT) == S_IFDIR;
+            string entry_path = entry->path;
+            scan_queue.push(entry);
+            if (!is_directory)
+                continue;
+
+            string item_path = prefix + contents[names[i]].first;
+            if (dir != NULL && open_dir_levels >= max_open_dir_levels) {
+                closedir(dir);
+                dir = NULL;
+                fd = AT_FDCWD;
+                open_dir_levels--;
+            }
+            if (dir != NULL
+                && !scan_directory(item_path, fd, contents[names[i]].first,
+                                   entry_path)) {
+                closedir(dir);
+                dir = NULL;
+                fd = AT_FDCWD;
+                open_dir_levels--;
+                scan_directory(item_path, fd, item_path, entry_path);
+            } else if (dir == NULL) {
+                scan_directory(item_path, fd, item_path, entry_path);
+            }
         }
+    }
 
-        filter_rules.restore();
+    filter_rules.restore();
+    if (dir != NULL) {
+        closedir(dir);
+        open_dir_levels--;
     }
+    return true;
+}
+
+static void *scan_thread(void *arg)
+{
+    const vector<string> *paths = static_cast<const vector<string> *>(arg);
+
+    for (size_t i = 0; i < paths->size(); i++)
+        scanfile((*paths)[i], AT_FDCWD, (*paths)[i], DT_UNKNOWN);
+
+    scan_queue.close();
+    return NULL;
 }
 
 void usage(const char *program)
 {
+    string codec_list;
+    vector<string> codecs = Codec::names();
+    for (size_t i = 0; i < codecs.size(); i++)
+        codec_list += (i > 0 ? ", " : "") + codecs[i];
+
     fprintf(
         stderr,
         "Cumulus %s\n\n"
@@ -642,33 +1153,74 @@ void usage(const char *program)
         "  --localdb=PATH       local backup metadata is stored in PATH\n"
         "  --tmpdir=PATH        path for temporarily storing backup files\n"
         "                           (defaults to TMPDIR environment variable or /tmp)\n"
-        "  --filter=COMMAND     program through which to filter segment data\n"
+        "  --compression=NAME   compress segment data in-process with the named\n"
+        "                           method (%s)\n"
+        "  --filter=COMMAND     program through which to filter segment data,\n"
+        "                           instead of --compression\n"
         "                           (defaults to \"bzip2 -c\")\n"
         "  --filter-extension=EXT\n"
         "                       string to append to segment files\n"
-        "                           (defaults to \".bz2\")\n"
+        "                           (defaults to \".bz2\", or the standard\n"
+        "                           extension for --compression)\n"
         "  --signature-filter=COMMAND\n"
         "                       program though which to filter descriptor\n"
         "  --scheme=NAME        optional name for this snapshot\n"
         "  --intent=FLOAT       DEPRECATED: ignored, and will be removed soon\n"
         "  --full-metadata      do not re-use metadata from previous backups\n"
         "  --rebuild-statcache  re-read all file data to verify statcache\n"
+        "  --threads=N          number of threads for reading file data\n"
+        "                           (defaults to the number of CPUs; 0 reads\n"
+        "                           all data in the main thread)\n"
+        "  --checksum-filter=MB use up to MB megabytes of memory to keep an index\n"
+        "                           of stored block checksums, avoiding database\n"
+        "                           lookups for new data (default: off)\n"
+        "  --compression-threads=N\n"
+        "                       number of segments to compress in parallel\n"
+        "                           (defaults to the number of CPUs; 0\n"
+        "                           compresses in the main thread)\n"
+        "  --upload-threads=N   number of files to send with --upload-script at\n"
+        "                           once, each with its own copy of the script\n"
+        "                           (default: 1)\n"
+        "  --content-defined-blocks\n"
+        "                       split files into blocks at boundaries chosen\n"
+        "                           from the data, so that insertions and\n"
+        "                           deletions do not shift later blocks\n"
+        "  --chunker=NAME       algorithm for splitting files into chunks for\n"
+        "                           sub-file incrementals (lbfs, fastcdc;\n"
+        "                           default: lbfs)\n"
+        "  --hash=NAME          checksum algorithm for file data (sha224, sha256,\n"
+        "                           sha1, blake3; default: sha224).  Blocks\n"
+        "                           stored with a different algorithm are not\n"
+        "                           matched, so changing it re-uploads data\n"
+        "  --staging-size=MB    pause the backup while files staged for\n"
+        "                           --upload-script would use more than MB\n"
+        "                           megabytes in --tmpdir (default: 64)\n"
         "  -v --verbose         list files as they are backed up\n"
         "\n"
         "Exactly one of --dest or --upload-script must be specified.\n",
-        cumulus_version, program
+        cumulus_version, program, codec_list.c_str()
     );
 }
 
 int main(int argc, char *argv[])
 {
     hash_init();
+    codec_init();
+    chunker_init();
 
     string backup_dest = "", backup_script = "";
     string localdb_dir = "";
     string backup_scheme = "";
     string signature_filter = "";
 
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int compression_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t checksum_filter_size = 0;
+    int upload_threads = 1;
+    size_t staging_size = RemoteStore::DEFAULT_STAGING_BYTES;
+    string compression = "";
+    bool filter_set = false, filter_extension_set = false;
+
     string tmp_dir = "/tmp";
     if (getenv("TMPDIR") != NULL)
         tmp_dir = getenv("TMPDIR");
@@ -689,6 +1241,15 @@ int main(int argc, char *argv[])
             {"include", 1, 0, 0},           // 11
             {"exclude", 1, 0, 0},           // 12
             {"dir-merge", 1, 0, 0},         // 13
+            {"threads", 1, 0, 0},           // 14
+            {"checksum-filter", 1, 0, 0},   // 15
+            {"compression-threads", 1, 0, 0}, // 16
+            {"compression", 1, 0, 0},       // 17
+            {"upload-threads", 1, 0, 0},    // 18
+            {"staging-size", 1, 0, 0},      // 19
+            {"chunker", 1, 0, 0},           // 20
+            {"content-defined-blocks", 0, 0, 0}, // 21
+            {"hash", 1, 0, 0},              // 22
             // Aliases for short options
             {"verbose", 0, 0, 'v'},
             {NULL, 0, 0, 0},
@@ -707,9 +1268,11 @@ int main(int argc, char *argv[])
                 break;
             case 1:     // --filter
                 filter_program = optarg;
+                filter_set = true;
                 break;
             case 2:     // --filter-extension
                 filter_extension = optarg;
+                filter_extension_set = true;
                 break;
             case 3:     // --dest
                 backup_dest = optarg;
@@ -746,6 +1309,43 @@ int main(int argc, char *argv[])
             case 13:    // --dir-merge
                 filter_rules.add_pattern(PathFilterList::DIRMERGE, optarg, "");
                 break;
+            case 14:    // --threads
+                num_threads = atoi(optarg);
+                break;
+            case 15:    // --checksum-filter
+                checksum_filter_size = (size_t)atoi(optarg) << 20;
+                break;
+            case 16:    // --compression-threads
+                compression_threads = atoi(optarg);
+                break;
+            case 17:    // --compression
+                compression = optarg;
+                break;
+            case 18:    // --upload-threads
+                upload_threads = atoi(optarg);
+                break;
+            case 19:    // --staging-size
+                staging_size = (size_t)atoi(optarg) << 20;
+                break;
+            case 20:    // --chunker
+                if (!Chunker::SetDefault(optarg)) {
+                    fprintf(stderr, "Error: Unknown chunking algorithm: %s\n",
+                            optarg);
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 21:    // --content-defined-blocks
+                content_defined_blocks = true;
+                break;
+            case 22:    // --hash
+                if (!Hash::SetDefault(optarg)) {
+                    fprintf(stderr, "Error: Unknown hash algorithm: %s\n",
+                            optarg);
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
             default:
                 fprintf(stderr, "Unhandled long option!\n");
                 return 1;
@@ -781,6 +1381,32 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /* Segments are compressed in-process if a codec is named, or if the
+     * filter program is one a codec can stand in for. */
+    string codec_extension;
+    if (compression != "") {
+        if (filter_set) {
+            fprintf(stderr, "Error: Cannot specify both --compression= "
+                    "and --filter=\n");
+            usage(argv[0]);
+            return 1;
+        }
+        scoped_ptr<Codec> codec(Codec::New(compression));
+        if (codec == NULL) {
+            fprintf(stderr, "Error: Unknown compression method: %s\n",
+                    compression.c_str());
+            usage(argv[0]);
+            return 1;
+        }
+        segment_codec = compression;
+        if (!filter_extension_set) {
+            codec_extension = codec->extension();
+            filter_extension = codec_extension.c_str();
+        }
+    } else {
+        segment_codec = Codec::for_filter(filter_program);
+    }
+
     // Default for --localdb is the same as --dest
     if (localdb_dir == "") {
         localdb_dir = backup_dest;
@@ -804,7 +1430,8 @@ int main(int argc, char *argv[])
                     tmp_dir.c_str());
             return 1;
         }
-        remote = new RemoteStore(tmp_dir, backup_script=backup_script);
+        remote = new RemoteStore(tmp_dir, backup_script, upload_threads,
+                                 staging_size);
     } else {
         remote = new RemoteStore(backup_dest);
     }
@@ -821,17 +1448,67 @@ int main(int argc, char *argv[])
      * snapshot. */
     string database_path = localdb_dir + "/localdb.sqlite";
     db = new LocalDb;
-    db->Open(database_path.c_str(), timestamp.c_str(), backup_scheme.c_str());
+    db->Open(database_path.c_str(), timestamp.c_str(), backup_scheme.c_str(),
+             checksum_filter_size);
 
-    tss = new TarSegmentStore(remote, db);
+    tss = new TarSegmentStore(remote, db, compression_threads);
 
     /* Initialize the stat cache, for skipping over unchanged files. */
     metawriter = new MetadataWriter(tss, localdb_dir.c_str(), timestamp.c_str(),
                                     backup_scheme.c_str());
 
-    for (int i = optind; i < argc; i++) {
-        scanfile(argv[i]);
+    /* Scan the file system in a separate thread, and dump each object found
+     * here, in order.  File contents are read by the reader pool. */
+    if (num_threads > 0)
+        reader_pool = new ReaderPool(num_threads);
+
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0
+        && nofile.rlim_cur != RLIM_INFINITY) {
+        max_open_dir_levels = min(max_open_dir_levels,
+                                  (size_t)nofile.rlim_cur / 8);
+        max_open_files = min(max_open_files, (size_t)nofile.rlim_cur / 4);
+    }
+    scan_statcache = new StatcacheReader(metawriter->old_statcache_path());
+
+    vector<string> scan_paths(&argv[optind], &argv[argc]);
+    pthread_t scanner;
+    if (pthread_create(&scanner, NULL, scan_thread, &scan_paths) != 0) {
+        fprintf(stderr, "Cannot create scanning thread: %m\n");
+        fatal("pthread_create");
+    }
+
+    ScanEntry *entry;
+    while ((entry = scan_queue.pop()) != NULL) {
+        /* Regular files not expected to be read, or beyond the scanner's
+         * limit on open files, were not opened while scanning; open them
+         * now. */
+        bool scanner_opened = entry->reader != NULL;
+        if ((entry->stat_buf.st_mode & S_IFMT) == S_IFREG
+            && entry->reader == NULL) {
+            int fd = safe_openat(AT_FDCWD, entry->fullpath, entry->fullpath,
+                                 &entry->stat_buf);
+            if (fd < 0) {
+                delete entry;
+                continue;
+            }
+            entry->reader = new FileReader(fd, entry->stat_buf);
+        }
+
+        dump_inode(entry->path, entry->fullpath, entry->stat_buf,
+                   entry->reader);
+        if (entry->reader != NULL)
+            entry->reader->unref();
+        if (scanner_opened)
+            scan_queue.release_file();
+        delete entry;
+    }
+
+    if (pthread_join(scanner, NULL) != 0) {
+        fprintf(stderr, "Warning: Unable to join scanning thread: %m\n");
     }
+    delete reader_pool;
+    delete scan_statcache;
 
     ObjectReference root_ref = metawriter->close();
     string backup_root = root_ref.to_string();
@@ -840,6 +1517,7 @@ int main(int argc, char *argv[])
 
     tss->sync();
     tss->dump_stats();
+    db->DumpStats();
     delete tss;
 
     /* Write out a summary file with metadata for all the segments in this
@@ -850,13 +1528,7 @@ int main(int argc, char *argv[])
         dbmeta_filename += backup_scheme + "-";
     dbmeta_filename += timestamp + ".meta" + filter_extension;
     RemoteFile *dbmeta_file = remote->alloc_file(dbmeta_filename, "meta");
-    scoped_ptr<FileFilter> dbmeta_filter(FileFilter::New(dbmeta_file->get_fd(),
-                                                         filter_program));
-    if (dbmeta_filter == NULL) {
-        fprintf(stderr, "Unable to open descriptor output file: %m\n");
-        return 1;
-    }
-    FILE *dbmeta = fdopen(dbmeta_filter->get_wrapped_fd(), "w");
+    CompressionJob dbmeta;
 
     std::set<string> segment_list = db->GetUsedSegments();
     for (std::set<string>::iterator i = segment_list.begin();
@@ -867,17 +1539,19 @@ int main(int argc, char *argv[])
             for (j = segment_metadata.begin();
                  j != segment_metadata.end(); ++j)
             {
-                fprintf(dbmeta, "%s: %s\n",
-                        j->first.c_str(), j->second.c_str());
+                dbmeta.data += j->first + ": " + j->second + "\n";
             }
-            fprintf(dbmeta, "\n");
+            dbmeta.data += "\n";
         }
     }
-    fclose(dbmeta);
-    dbmeta_filter->wait();
 
-    string dbmeta_csum
-        = Hash::hash_file(dbmeta_file->get_local_path().c_str());
+    // Compressed in the same way as the segments.
+    dbmeta.fd = dbmeta_file->get_fd();
+    dbmeta.codec = segment_codec;
+    dbmeta.filter = filter_program;
+    compress_segment(&dbmeta);
+
+    string dbmeta_csum = dbmeta.checksum;
     dbmeta_file->send();
 
     db->Close();
@@ -934,6 +1608,7 @@ int main(int argc, char *argv[])
     descriptor_file->send();
 
     remote->sync();
+    remote->dump_stats();
     delete remote;
 
     if (backup_script != "") {
@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <string>
 #include <iostream>
 #include <map>
@@ -50,44 +51,6 @@ bool flag_full_metadata = false;
 /* TODO: Move to header file */
 extern LocalDb *db;
 
-/* Like strcmp, but sorts in the order that files will be visited in the
- * filesystem.  That is, we break paths apart at slashes, and compare path
- * components separately. */
-static int pathcmp(const char *path1, const char *path2)
-{
-    /* Find the first component in each path. */
-    const char *slash1 = strchr(path1, '/');
-    const char *slash2 = strchr(path2, '/');
-
-    {
-        string comp1, comp2;
-        if (slash1 == NULL)
-            comp1 = path1;
-        else
-            comp1 = string(path1, slash1 - path1);
-
-        if (slash2 == NULL)
-            comp2 = path2;
-        else
-            comp2 = string(path2, slash2 - path2);
-
-        /* Directly compare the two components first. */
-        if (comp1 < comp2)
-            return -1;
-        if (comp1 > comp2)
-            return 1;
-    }
-
-    if (slash1 == NULL && slash2 == NULL)
-        return 0;
-    if (slash1 == NULL)
-        return -1;
-    if (slash2 == NULL)
-        return 1;
-
-    return pathcmp(slash1 + 1, slash2 + 1);
-}
-
 /* Encode a dictionary of string key/value pairs into a sequence of lines of
  * the form "key: value".  If it exists, the key "name" is treated specially
  * and will be listed first. */
@@ -115,172 +78,31 @@ MetadataWriter::MetadataWriter(TarSegmentStore *store,
                                const char *snapshot_scheme)
 {
     statcache_path = path;
-    statcache_path += "/statcache2";
-    if (snapshot_scheme != NULL && strlen(snapshot_scheme) > 0)
+    statcache_path += "/statcache3";
+    string text_statcache_path = string(path) + "/statcache2";
+    if (snapshot_scheme != NULL && strlen(snapshot_scheme) > 0) {
         statcache_path = statcache_path + "-" + snapshot_scheme;
+        text_statcache_path = text_statcache_path + "-" + snapshot_scheme;
+    }
     statcache_tmp_path = statcache_path + "." + snapshot_name;
 
-    statcache_in = fopen(statcache_path.c_str(), "r");
+    /* Convert a statcache left by an older version to the binary format, so
+     * that the first backup after upgrading need not re-read every file. */
+    if (access(statcache_path.c_str(), F_OK) < 0
+        && statcache_convert(text_statcache_path, statcache_path))
+        unlink(text_statcache_path.c_str());
 
-    statcache_out = fopen(statcache_tmp_path.c_str(), "w");
-    if (statcache_out == NULL) {
-        fprintf(stderr, "Error opening statcache %s: %m\n",
-                statcache_tmp_path.c_str());
-        fatal("Error opening statcache");
-    }
-
-    old_metadata_eof = false;
+    statcache = new StatcacheReader(statcache_path);
+    statcache_out = new StatcacheWriter(statcache_tmp_path);
 
     this->store = store;
     chunk_size = 0;
 }
 
-/* Read the next entry from the old statcache file, loading it into
- * old_metadata. */
-void MetadataWriter::read_statcache()
-{
-    if (statcache_in == NULL) {
-        old_metadata_eof = true;
-        return;
-    }
-
-    old_metadata.clear();
-
-    char *buf = NULL;
-    size_t n = 0;
-    string field = "";          // Last field to be read in
-
-    /* Look for a first line starting with "@@", which tells where the metadata
-     * can be found in the metadata log of an old snapshot. */
-    if (getline(&buf, &n, statcache_in) < 0
-        || buf == NULL || buf[0] != '@' || buf[1] != '@') {
-        old_metadata_eof = true;
-        return;
-    }
-
-    if (strchr(buf, '\n') != NULL)
-        *strchr(buf, '\n') = '\0';
-    old_metadata_loc = buf + 2;
-
-    /* After the initial line follows the metadata, as key-value pairs. */
-    while (!feof(statcache_in)) {
-        if (getline(&buf, &n, statcache_in) < 0)
-            break;
-
-        char *eol = strchr(buf, '\n');
-        if (eol != NULL)
-            *eol = '\0';
-
-        /* Is the line blank?  If so, we have reached the end of this entry. */
-        if (buf[0] == '\0')
-            break;
-
-        /* Is this a continuation line?  (Does it start with whitespace?) */
-        if (isspace(buf[0]) && field != "") {
-            old_metadata[field] += string("\n") + buf;
-            continue;
-        }
-
-        /* For lines of the form "Key: Value" look for ':' and split the line
-         * apart. */
-        char *value = strchr(buf, ':');
-        if (value == NULL)
-            continue;
-        *value = '\0';
-        field = buf;
-
-        value++;
-        while (isspace(*value))
-            value++;
-
-        old_metadata[field] = value;
-    }
-
-    if (feof(statcache_in) && old_metadata.size() == 0) {
-        old_metadata_eof = true;
-    }
-
-    free(buf);
-}
-
-bool MetadataWriter::find(const string& path)
+MetadataWriter::~MetadataWriter()
 {
-    const char *path_str = path.c_str();
-    while (!old_metadata_eof) {
-        string old_path = uri_decode(old_metadata["name"]);
-        int cmp = pathcmp(old_path.c_str(), path_str);
-        if (cmp == 0)
-            return true;
-        else if (cmp > 0)
-            return false;
-        else
-            read_statcache();
-    }
-
-    return false;
-}
-
-/* Does a file appear to be unchanged from the previous time it was backed up,
- * based on stat information? */
-bool MetadataWriter::is_unchanged(const struct stat *stat_buf)
-{
-    if (old_metadata.find("volatile") != old_metadata.end()
-        && parse_int(old_metadata["volatile"]) != 0)
-        return false;
-
-    if (old_metadata.find("ctime") == old_metadata.end())
-        return false;
-    if (stat_buf->st_ctime != parse_int(old_metadata["ctime"]))
-        return false;
-
-    if (old_metadata.find("mtime") == old_metadata.end())
-        return false;
-    if (stat_buf->st_mtime != parse_int(old_metadata["mtime"]))
-        return false;
-
-    if (old_metadata.find("size") == old_metadata.end())
-        return false;
-    if (stat_buf->st_size != parse_int(old_metadata["size"]))
-        return false;
-
-    if (old_metadata.find("inode") == old_metadata.end())
-        return false;
-    string inode = encode_int(major(stat_buf->st_dev))
-        + "/" + encode_int(minor(stat_buf->st_dev))
-        + "/" + encode_int(stat_buf->st_ino);
-    if (inode != old_metadata["inode"])
-        return false;
-
-    return true;
-}
-
-list<ObjectReference> MetadataWriter::get_blocks()
-{
-    list<ObjectReference> blocks;
-
-    /* Parse the list of blocks. */
-    const char *s = old_metadata["data"].c_str();
-    while (*s != '\0') {
-        if (isspace(*s)) {
-            s++;
-            continue;
-        }
-
-        string ref = "";
-        while (*s != '\0' && !isspace(*s)) {
-            char buf[2];
-            buf[0] = *s;
-            buf[1] = '\0';
-            ref += buf;
-            s++;
-        }
-
-        ObjectReference r = ObjectReference::parse(ref);
-        if (!r.is_null())
-            blocks.push_back(r);
-    }
-
-    return blocks;
+    delete statcache;
+    delete statcache_out;
 }
 
 /* Ensure contents of metadata are flushed to an object. */
@@ -356,8 +178,7 @@ void MetadataWriter::metadata_flush()
         if (i->reused)
             r = i->ref;
 
-        string refstr = r.to_string();
-        fprintf(statcache_out, "@@%s\n%s", refstr.c_str(), i->text.c_str());
+        statcache_out->add(r.to_string(), i->info, i->text);
     }
 
     chunk_size = 0;
@@ -370,9 +191,10 @@ void MetadataWriter::add(dictionary info)
     item.offset = 0;
     item.reused = false;
     item.text += encode_dict(info) + "\n";
+    item.info = info;
 
-    if (info == old_metadata && !flag_full_metadata) {
-        ObjectReference ref = ObjectReference::parse(old_metadata_loc);
+    if (statcache->matches(item.text) && !flag_full_metadata) {
+        ObjectReference ref = statcache->old_ref();
         if (!ref.is_null() && db->IsAvailable(ref)) {
             item.reused = true;
             item.ref = ref;
@@ -400,7 +222,7 @@ ObjectReference MetadataWriter::close()
     ObjectReference ref = root->get_ref();
     delete root;
 
-    fclose(statcache_out);
+    statcache_out->close();
     if (rename(statcache_tmp_path.c_str(), statcache_path.c_str()) < 0) {
         fprintf(stderr, "Error renaming statcache from %s to %s: %m\n",
                 statcache_tmp_path.c_str(), statcache_path.c_str());
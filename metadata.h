@@ -35,6 +35,7 @@
 
 #include "store.h"
 #include "ref.h"
+#include "statcache.h"
 #include "util.h"
 
 extern bool flag_full_metadata;
@@ -43,6 +44,7 @@ extern bool flag_full_metadata;
 struct MetadataItem {
     int offset;
     std::string text;
+    dictionary info;
 
     bool reused;
     ObjectReference ref;
@@ -52,40 +54,39 @@ class MetadataWriter {
 public:
     MetadataWriter(TarSegmentStore *store, const char *path,
                    const char *snapshot_name, const char *snapshot_scheme);
+    ~MetadataWriter();
     void add(dictionary info);
     ObjectReference close();
 
-    bool find(const std::string& path);
-    ObjectReference old_ref() const {
-        return ObjectReference::parse(old_metadata_loc);
-    }
+    bool find(const std::string& path) { return statcache->find(path); }
+    ObjectReference old_ref() const { return statcache->old_ref(); }
 
-    bool is_unchanged(const struct stat *stat_buf);
+    bool is_unchanged(const struct stat *stat_buf)
+        { return statcache->is_unchanged(stat_buf); }
 
-    dictionary get_old_metadata() const { return old_metadata; }
-    std::list<ObjectReference> get_blocks();
-    std::string get_checksum() { return old_metadata["checksum"]; }
+    std::list<ObjectReference> get_blocks()
+        { return statcache->get_blocks(); }
+    std::string get_checksum() { return statcache->get_checksum(); }
+
+    // Path to the statcache from the previous backup, so that additional
+    // readers may be opened on it.
+    const std::string &old_statcache_path() const { return statcache_path; }
 
 private:
     void metadata_flush();
-    void read_statcache();
 
     // Where are objects eventually written to?
     TarSegmentStore *store;
 
-    // File descriptors for reading/writing local statcache data
+    // Paths and objects for reading/writing local statcache data
     std::string statcache_path, statcache_tmp_path;
-    FILE *statcache_in, *statcache_out;
+    StatcacheWriter *statcache_out;
+    StatcacheReader *statcache;
 
     // Metadata not yet written out to the segment store
     size_t chunk_size;
     std::list<MetadataItem> items;
     std::ostringstream metadata_root;
-
-    // Statcache information read back in from a previous run
-    bool old_metadata_eof;
-    dictionary old_metadata;
-    std::string old_metadata_loc;   // Reference to where the metadata is found
 };
 
 #endif // _LBS_METADATA_H
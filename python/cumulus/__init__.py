@@ -44,6 +44,7 @@ try:
 except ImportError:
     import thread as _thread
 
+import cumulus.blake3hash
 import cumulus.store
 import cumulus.store.file
 
@@ -68,6 +69,9 @@ SEGMENT_FILTERS = [
     (".gpg", "cumulus-filter-gpg --decrypt"),
     (".gz", "gzip -dc"),
     (".bz2", "bzip2 -dc"),
+    (".xz", "xz -dc"),
+    (".zst", "zstd -dc"),
+    (".lz4", "lz4 -dc"),
     ("", None),
 ]
 
@@ -104,6 +108,7 @@ CHECKSUM_ALGORITHMS = {
     'sha1': hashlib.sha1,
     'sha224': hashlib.sha224,
     'sha256': hashlib.sha256,
+    'blake3': cumulus.blake3hash.blake3,
 }
 
 class ChecksumCreator:
@@ -791,6 +796,11 @@ class LocalDatabase:
                        where blockid not in
                            (select blockid from block_index)""")
 
+        # Forget the contents of files not seen in any current snapshot.
+        cur.execute("""delete from file_index
+                       where snapshotid not in
+                           (select snapshotid from snapshots)""")
+
     # Segment cleaning.
     class SegmentInfo(Struct): pass
 
@@ -0,0 +1,134 @@
+# Cumulus: Efficient Filesystem Backup to the Cloud
+# Copyright (C) 2013 The Cumulus Developers
+# See the AUTHORS file for a list of contributors.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+"""BLAKE3 hashing, for checksums written by "cumulus --hash=blake3".
+
+The blake3 module (https://pypi.org/project/blake3/) is used if it is
+installed.  Otherwise this falls back to a pure-Python implementation of the
+default BLAKE3 hashing mode, which is correct but slow.
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import binascii
+import struct
+
+try:
+    from blake3 import blake3
+except ImportError:
+    blake3 = None
+
+OUT_LEN = 32
+BLOCK_LEN = 64
+CHUNK_LEN = 1024
+
+CHUNK_START = 1 << 0
+CHUNK_END = 1 << 1
+PARENT = 1 << 2
+ROOT = 1 << 3
+
+IV = (0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19)
+
+MSG_PERMUTATION = (2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8)
+
+MASK = 0xffffffff
+
+def _g(v, a, b, c, d, x, y):
+    v[a] = (v[a] + v[b] + x) & MASK
+    t = v[d] ^ v[a]
+    v[d] = ((t >> 16) | (t << 16)) & MASK
+    v[c] = (v[c] + v[d]) & MASK
+    t = v[b] ^ v[c]
+    v[b] = ((t >> 12) | (t << 20)) & MASK
+    v[a] = (v[a] + v[b] + y) & MASK
+    t = v[d] ^ v[a]
+    v[d] = ((t >> 8) | (t << 24)) & MASK
+    v[c] = (v[c] + v[d]) & MASK
+    t = v[b] ^ v[c]
+    v[b] = ((t >> 7) | (t << 25)) & MASK
+
+def _compress(cv, block, block_len, counter, flags):
+    """Return the chaining value (first eight output words)."""
+    m = list(struct.unpack("<16I", block))
+    v = list(cv) + list(IV[0:4]) + [counter & MASK, (counter >> 32) & MASK,
+                                    block_len, flags]
+    for r in range(7):
+        _g(v, 0, 4, 8, 12, m[0], m[1])
+        _g(v, 1, 5, 9, 13, m[2], m[3])
+        _g(v, 2, 6, 10, 14, m[4], m[5])
+        _g(v, 3, 7, 11, 15, m[6], m[7])
+        _g(v, 0, 5, 10, 15, m[8], m[9])
+        _g(v, 1, 6, 11, 12, m[10], m[11])
+        _g(v, 2, 7, 8, 13, m[12], m[13])
+        _g(v, 3, 4, 9, 14, m[14], m[15])
+        m = [m[i] for i in MSG_PERMUTATION]
+    return [v[i] ^ v[i + 8] for i in range(8)]
+
+def _parent_cv(left, right, flags=0):
+    block = struct.pack("<16I", *(list(left) + list(right)))
+    return _compress(IV, block, BLOCK_LEN, 0, PARENT | flags)
+
+class Blake3Python:
+    """Pure-Python BLAKE3 hash object, with the hashlib interface."""
+
+    def __init__(self):
+        self.cv_stack = []
+        self.chunk_counter = 0
+        self.chunk = b""
+
+    def _finish_chunk(self, chunk, flags=0):
+        cv = IV
+        nblocks = max(1, (len(chunk) + BLOCK_LEN - 1) // BLOCK_LEN)
+        for i in range(nblocks):
+            block = chunk[i * BLOCK_LEN:(i + 1) * BLOCK_LEN]
+            block_flags = 0
+            if i == 0: block_flags |= CHUNK_START
+            if i == nblocks - 1: block_flags |= CHUNK_END | flags
+            cv = _compress(cv, block.ljust(BLOCK_LEN, b"\0"), len(block),
+                           self.chunk_counter, block_flags)
+        return cv
+
+    def update(self, data):
+        self.chunk += data
+        # The final chunk is kept buffered until the digest is requested.
+        while len(self.chunk) > CHUNK_LEN:
+            cv = self._finish_chunk(self.chunk[:CHUNK_LEN])
+            self.chunk = self.chunk[CHUNK_LEN:]
+            self.chunk_counter += 1
+            total = self.chunk_counter
+            while total & 1 == 0:
+                cv = _parent_cv(self.cv_stack.pop(), cv)
+                total >>= 1
+            self.cv_stack.append(cv)
+
+    def digest(self):
+        if not self.cv_stack:
+            cv = self._finish_chunk(self.chunk, ROOT)
+        else:
+            cv = self._finish_chunk(self.chunk)
+            for i in range(len(self.cv_stack) - 1, 0, -1):
+                cv = _parent_cv(self.cv_stack[i], cv)
+            cv = _parent_cv(self.cv_stack[0], cv, ROOT)
+        return struct.pack("<8I", *cv)
+
+    def hexdigest(self):
+        return binascii.hexlify(self.digest()).decode("ascii")
+
+if blake3 is None:
+    blake3 = Blake3Python
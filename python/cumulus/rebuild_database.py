@@ -29,11 +29,13 @@ given data from a previous backup.
 from __future__ import division, print_function, unicode_literals
 
 import base64
+import binascii
 import hashlib
 import itertools
 import os
 import re
 import struct
+import sqlite3
 import subprocess
 import sys
 import tarfile
@@ -222,6 +224,7 @@ class DatabaseRebuilder(object):
         self.database = database
         self.cursor = database.cursor()
         self.segment_ids = {}
+        self.algorithm_ids = {}
         self.chunker = ChunkerExternal()
         #self.chunker = Chunker()
 
@@ -236,6 +239,24 @@ class DatabaseRebuilder(object):
         self.segment_ids[segment] = id
         return id
 
+    def algorithm_to_id(self, algorithm):
+        if algorithm in self.algorithm_ids: return self.algorithm_ids[algorithm]
+
+        self.cursor.execute("""insert or ignore into checksum_algorithms(name)
+                               values (?)""", (algorithm,))
+        self.cursor.execute("""select algorithmid from checksum_algorithms
+                               where name = ?""", (algorithm,))
+        id = self.cursor.fetchone()[0]
+        self.algorithm_ids[algorithm] = id
+        return id
+
+    def encode_checksum(self, checksum):
+        """Convert an "algorithm=hexdigest" checksum to the binary form stored
+        in block_index: a pair (algorithm id, raw digest)."""
+        (algorithm, digest) = checksum.split("=", 1)
+        return (self.algorithm_to_id(algorithm),
+                sqlite3.Binary(binascii.unhexlify(digest)))
+
     def rebuild(self, metadata, reference_path):
         """Iterate through old metadata and use it to rebuild the database.
 
@@ -342,10 +363,11 @@ class DatabaseRebuilder(object):
             # Store checksum only if it is available; we don't want to
             # overwrite an existing checksum in the database with NULL.
             if checksum is not None:
+                (algorithmid, digest) = self.encode_checksum(checksum)
                 self.cursor.execute("""update block_index
-                                       set checksum = ?
+                                       set algorithmid = ?, checksum = ?
                                        where blockid = ?""",
-                                    (checksum, blockid))
+                                    (algorithmid, digest, blockid))
 
             # Update the object size.  Our size may be an estimate, based on
             # slices that we have seen.  The size in the database must not be
@@ -453,8 +475,9 @@ if __name__ == "__main__":
         rebuilder.reload_segment_metadata(open(sys.argv[2]))
         sys.exit(0)
 
-    # Read metadata from stdin; filter out lines starting with "@@" so the
-    # statcache file can be parsed as well.
+    # Read metadata from stdin; filter out lines starting with "@@" so that a
+    # statcache can be parsed as well.  The statcache itself is binary, so pipe
+    # in the output of "cumulus-statcache-dump STATCACHE" instead of the file.
     metadata = (x for x in sys.stdin if not x.startswith("@@"))
 
     rebuilder = DatabaseRebuilder(cumulus.LocalDatabase(sys.argv[1]))
@@ -0,0 +1,596 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reading of file contents for a backup, possibly in parallel using a pool of
+ * worker threads.  See reader.h for an overview. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "chunker.h"
+#include "reader.h"
+#include "subfile.h"
+#include "util.h"
+
+using std::list;
+using std::min;
+using std::string;
+using std::vector;
+
+bool content_defined_blocks = false;
+
+/* Parameters for content-defined blocks: at least a quarter of LBS_BLOCK_SIZE,
+ * usually close to LBS_BLOCK_SIZE, and at most MAX_CONTENT_BLOCK_SIZE. */
+static const FastCdcParams content_block_params(
+    LBS_BLOCK_SIZE / 4, LBS_BLOCK_SIZE, MAX_CONTENT_BLOCK_SIZE, 19);
+
+static size_t buffer_size()
+{
+    return content_defined_blocks ? MAX_CONTENT_BLOCK_SIZE : LBS_BLOCK_SIZE;
+}
+
+/* Block buffers are recycled rather than freed, since allocations this large
+ * are otherwise handed back to the kernel and re-faulted in for each block. */
+static const size_t MAX_FREE_BUFFER_BYTES = 64 << 20;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static list<char *> free_buffers;
+
+static char *alloc_buffer()
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&buffer_lock);
+    if (!free_buffers.empty()) {
+        buf = free_buffers.front();
+        free_buffers.pop_front();
+    }
+    pthread_mutex_unlock(&buffer_lock);
+
+    if (buf == NULL)
+        buf = new char[buffer_size()];
+    return buf;
+}
+
+static void free_buffer(char *buf)
+{
+    pthread_mutex_lock(&buffer_lock);
+    if (free_buffers.size() < MAX_FREE_BUFFER_BYTES / buffer_size()) {
+        free_buffers.push_back(buf);
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&buffer_lock);
+
+    delete[] buf;
+}
+
+ssize_t file_read(int fd, char *buf, size_t maxlen)
+{
+    size_t bytes_read = 0;
+
+    while (true) {
+        ssize_t res = read(fd, buf, maxlen);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error reading file: %m\n");
+            return -1;
+        } else if (res == 0) {
+            break;
+        } else {
+            bytes_read += res;
+            buf += res;
+            maxlen -= res;
+        }
+    }
+
+    return bytes_read;
+}
+
+/* Test whether a buffer is all zeroes, a machine word at a time.  Several
+ * words are combined per test, which the compiler can turn into vector
+ * instructions. */
+static bool is_all_zero(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && (uintptr_t)&buf[i] % sizeof(uint64_t) != 0) {
+        if (buf[i] != 0)
+            return false;
+        i++;
+    }
+
+    const size_t STRIDE = 8 * sizeof(uint64_t);
+    for (; i + STRIDE <= len; i += STRIDE) {
+        const uint64_t *w = reinterpret_cast<const uint64_t *>(&buf[i]);
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+            return false;
+    }
+
+    for (; i < len; i++) {
+        if (buf[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/* Largest file offset, used as the end of a region reaching to the end of the
+ * file. */
+static const off_t OFFSET_MAX
+    = (off_t)((((uint64_t)1) << (sizeof(off_t) * 8 - 1)) - 1);
+
+FileReader::FileReader(int fd, const struct stat &stat_buf)
+    : refcount(1), pool(NULL), fd(fd), file_hash(Hash::New()), offset(0), hole_end(0),
+      data_end(OFFSET_MAX), file_size(0), advised_end(0), carry_buf(NULL),
+      carry_len(0), claimed(false), reading_inline(false), finished(false),
+      cancelled(false), error(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    if (S_ISREG(stat_buf.st_mode)) {
+        file_size = stat_buf.st_size;
+
+        // Only look for holes in files with fewer blocks allocated than
+        // their size calls for; most files have none, and this saves the
+        // system calls.
+        if (stat_buf.st_blocks * 512 < stat_buf.st_size)
+            data_end = 0;
+    }
+}
+
+FileReader::~FileReader()
+{
+    while (!ready.empty()) {
+        release_block(ready.front());
+        ready.pop_front();
+    }
+
+    if (carry_buf != NULL)
+        free_buffer(carry_buf);
+
+    close(fd);
+    delete file_hash;
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void FileReader::ref()
+{
+    pthread_mutex_lock(&lock);
+    refcount++;
+    pthread_mutex_unlock(&lock);
+}
+
+void FileReader::unref()
+{
+    pthread_mutex_lock(&lock);
+    bool last = (--refcount == 0);
+    pthread_mutex_unlock(&lock);
+
+    if (last)
+        delete this;
+}
+
+bool FileReader::claim()
+{
+    pthread_mutex_lock(&lock);
+    bool result = !claimed;
+    claimed = true;
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+void FileReader::read_ahead()
+{
+    off_t start = std::max(offset, advised_end);
+    off_t end = std::min(offset + (off_t)(READ_AHEAD_BLOCKS * buffer_size()),
+                         file_size);
+    if (start >= end)
+        return;
+
+    // Files are read sequentially, which allows more aggressive read-ahead
+    // by the kernel.  This is left until now so that files which are opened
+    // but never read cost no extra system calls.
+    if (advised_end == 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+    advised_end = end;
+}
+
+bool FileReader::physical_offset(uint64_t *offset)
+{
+    // Room for the first extent only.
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent))
+                 / sizeof(uint64_t) + 1];
+    memset(buf, 0, sizeof(buf));
+    struct fiemap *map = reinterpret_cast<struct fiemap *>(buf);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) < 0 || map->fm_mapped_extents == 0)
+        return false;
+
+    // Data not yet allocated, or stored inline with the metadata, has no
+    // location of its own to order by.
+    const struct fiemap_extent &extent = map->fm_extents[0];
+    if (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+                           | FIEMAP_EXTENT_DATA_INLINE))
+        return false;
+
+    *offset = extent.fe_physical;
+    return true;
+}
+
+ReadBlock *FileReader::read_block()
+{
+    if (error)
+        return NULL;
+
+    read_ahead();
+
+    // Start with any data left over from the previous block.
+    char *buf = carry_buf;
+    size_t len = carry_len;
+    if (buf == NULL)
+        buf = alloc_buffer();
+    carry_buf = NULL;
+    carry_len = 0;
+
+    bool hole;
+    ssize_t bytes = read_data(buf + len, buffer_size() - len, &hole);
+    if (len > 0)
+        hole = false;
+    if (bytes < 0)
+        error = true;
+    else
+        len += bytes;
+
+    if (error || len == 0) {
+        free_buffer(buf);
+        file_checksum = file_hash->digest_str();
+        return NULL;
+    }
+
+    // Unless at the end of the file, the buffer is now full, so that the
+    // breakpoint found depends only on the data and not on how it was read.
+    if (content_defined_blocks) {
+        size_t block_len = fastcdc_next_chunk(content_block_params, buf, len);
+        if (block_len < len) {
+            carry_buf = alloc_buffer();
+            carry_len = len - block_len;
+            memcpy(carry_buf, buf + block_len, carry_len);
+            len = block_len;
+        }
+    }
+
+    ReadBlock *block = new ReadBlock;
+    block->data = buf;
+    block->len = len;
+
+    // Sparse file processing: if we read a block of all zeroes, it will be
+    // encoded explicitly and needs no further analysis.  There is no need to
+    // check blocks which were entirely in a hole.
+    block->all_zero = hole || is_all_zero(buf, len);
+
+    // The file checksum, block checksum, and chunk signatures are all
+    // computed in one pass over the data.
+    if (block->all_zero) {
+        file_hash->update(buf, len);
+    } else {
+        Subfile::compute_chunks(buf, len, &block->chunks, &block->checksum,
+                                file_hash);
+    }
+
+    return block;
+}
+
+ssize_t FileReader::read_data(char *buf, size_t maxlen, bool *hole)
+{
+    size_t bytes_read = 0;
+    *hole = true;
+
+    while (bytes_read < maxlen) {
+        if (offset < hole_end) {
+            size_t n = min((off_t)(maxlen - bytes_read), hole_end - offset);
+            memset(buf + bytes_read, 0, n);
+            bytes_read += n;
+            offset += n;
+            continue;
+        }
+
+        // Find the next data region, and the hole (or end of file) after it.
+        // If SEEK_DATA fails with ENXIO, the rest of the file is a hole; on
+        // any other error, give up on finding holes.
+        if (offset >= data_end) {
+            off_t data = lseek(fd, offset, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) {
+                struct stat stat_buf;
+                if (fstat(fd, &stat_buf) < 0 || offset >= stat_buf.st_size)
+                    break;
+                hole_end = data_end = stat_buf.st_size;
+            } else if (data < 0) {
+                hole_end = offset;
+                data_end = OFFSET_MAX;
+            } else {
+                hole_end = data;
+                data_end = lseek(fd, data, SEEK_HOLE);
+                if (data_end <= data)
+                    data_end = OFFSET_MAX;
+            }
+            continue;
+        }
+
+        size_t n = min((off_t)(maxlen - bytes_read), data_end - offset);
+        ssize_t res = pread(fd, buf + bytes_read, n, offset);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error reading file: %m\n");
+            return -1;
+        } else if (res == 0) {
+            break;
+        }
+        bytes_read += res;
+        offset += res;
+        *hole = false;
+    }
+
+    return bytes_read;
+}
+
+void FileReader::run()
+{
+    while (true) {
+        pthread_mutex_lock(&lock);
+        bool full = ready.size() >= MAX_READY_BLOCKS && !cancelled;
+        pthread_mutex_unlock(&lock);
+
+        // While waiting on the consumer, let the pool know, so that the
+        // consumer does not in turn wait for this thread to reach the file it
+        // wants next.
+        if (full) {
+            pool->set_stalled(true);
+            pthread_mutex_lock(&lock);
+            while (ready.size() >= MAX_READY_BLOCKS && !cancelled)
+                pthread_cond_wait(&cond, &lock);
+            pthread_mutex_unlock(&lock);
+            pool->set_stalled(false);
+        }
+
+        pthread_mutex_lock(&lock);
+        bool stop = cancelled;
+        pthread_mutex_unlock(&lock);
+
+        ReadBlock *block = stop ? NULL : read_block();
+
+        pthread_mutex_lock(&lock);
+        if (block == NULL)
+            finished = true;
+        else
+            ready.push_back(block);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        if (block == NULL)
+            break;
+    }
+}
+
+ReadBlock *FileReader::next_block()
+{
+    // If no worker has started on this file yet, wait for one to get to it
+    // (so that files are still read in the order submitted), but read it here
+    // if there is no pool or all of the workers are blocked on the consumer.
+    if (!reading_inline) {
+        if (pool != NULL)
+            pool->wait_for_worker(this);
+        reading_inline = claim();
+    }
+
+    if (reading_inline) {
+        ReadBlock *block = read_block();
+        if (block == NULL) {
+            pthread_mutex_lock(&lock);
+            finished = true;
+            pthread_mutex_unlock(&lock);
+        }
+        return block;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    while (ready.empty() && !finished)
+        pthread_cond_wait(&cond, &lock);
+
+    ReadBlock *block = NULL;
+    if (!ready.empty()) {
+        block = ready.front();
+        ready.pop_front();
+        pthread_cond_broadcast(&cond);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return block;
+}
+
+void FileReader::release_block(ReadBlock *block)
+{
+    free_buffer(block->data);
+    delete block;
+}
+
+bool FileReader::read_error()
+{
+    pthread_mutex_lock(&lock);
+    bool result = error;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+string FileReader::checksum()
+{
+    pthread_mutex_lock(&lock);
+    string result = file_checksum;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void FileReader::cancel()
+{
+    pthread_mutex_lock(&lock);
+    cancelled = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+ReaderPool::ReaderPool(int num_threads)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    pthread_cond_init(&progress, NULL);
+    stalled = 0;
+    terminate = false;
+
+    threads.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, ReaderPool::start_worker_thread,
+                           (void *)this) != 0) {
+            fprintf(stderr, "Cannot create reader thread: %m\n");
+            fatal("pthread_create");
+        }
+    }
+}
+
+/* Shut down the worker threads.  Files still in the queue are not read. */
+ReaderPool::~ReaderPool()
+{
+    pthread_mutex_lock(&lock);
+    terminate = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Warning: Unable to join reader thread: %m\n");
+        }
+    }
+
+    while (!queue.empty()) {
+        queue.front()->unref();
+        queue.pop_front();
+    }
+
+    pthread_cond_destroy(&progress);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+/* Queue a file to be read by a worker thread.  Files are picked up in the order
+ * submitted, which need not be the order in which they are consumed.  The
+ * consumer waits for a worker to pick up the file it needs next, unless every
+ * worker is waiting for the consumer to take blocks of other files; then it
+ * reads the file itself (see next_block), so it can never deadlock with the
+ * workers. */
+void ReaderPool::submit(FileReader *reader)
+{
+    // Get the start of the file on its way from disk while it waits for a
+    // worker.  No thread can be reading the file yet.
+    reader->read_ahead();
+    reader->ref();
+    reader->pool = this;
+
+    pthread_mutex_lock(&lock);
+    queue.push_back(reader);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void *ReaderPool::start_worker_thread(void *arg)
+{
+    ReaderPool *pool = static_cast<ReaderPool *>(arg);
+    pool->worker_thread();
+    return NULL;
+}
+
+void ReaderPool::worker_thread()
+{
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (queue.empty() && !terminate)
+            pthread_cond_wait(&cond, &lock);
+        if (terminate) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        FileReader *reader = queue.front();
+        queue.pop_front();
+        pthread_mutex_unlock(&lock);
+
+        if (reader->claim()) {
+            pthread_mutex_lock(&lock);
+            pthread_cond_broadcast(&progress);
+            pthread_mutex_unlock(&lock);
+
+            reader->run();
+        }
+        reader->unref();
+    }
+}
+
+void ReaderPool::set_stalled(bool is_stalled)
+{
+    pthread_mutex_lock(&lock);
+    if (is_stalled)
+        stalled++;
+    else
+        stalled--;
+    pthread_cond_broadcast(&progress);
+    pthread_mutex_unlock(&lock);
+}
+
+void ReaderPool::wait_for_worker(FileReader *reader)
+{
+    pthread_mutex_lock(&lock);
+    while (stalled < threads.size()) {
+        pthread_mutex_lock(&reader->lock);
+        bool claimed = reader->claimed;
+        pthread_mutex_unlock(&reader->lock);
+        if (claimed)
+            break;
+        pthread_cond_wait(&progress, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
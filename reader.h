@@ -0,0 +1,205 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reading of file contents for a backup.  Each regular file to be dumped is
+ * read through a FileReader, which splits the file into blocks and computes
+ * the checksums and subfile chunk signatures needed for each block.  None of
+ * this work touches the local database or the segment store, so a ReaderPool
+ * of worker threads can run many FileReaders in parallel, ahead of the single
+ * thread which consumes the blocks in order and writes out the backup. */
+
+#ifndef _CUMULUS_READER_H
+#define _CUMULUS_READER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "subfile.h"
+
+/* Files are read and deduplicated in blocks of this size. */
+static const size_t LBS_BLOCK_SIZE = 1024 * 1024;
+
+/* If set, block boundaries are instead chosen based on the file contents, so
+ * that inserting or deleting data only changes the blocks around the edit.
+ * Blocks are then of variable size, about LBS_BLOCK_SIZE on average and at
+ * most MAX_CONTENT_BLOCK_SIZE.  Must be set before any files are read. */
+extern bool content_defined_blocks;
+static const size_t MAX_CONTENT_BLOCK_SIZE = 2 * LBS_BLOCK_SIZE;
+
+/* Read data from a file descriptor and return the amount of data read.  A
+ * short read (less than the requested size) will only occur if end-of-file is
+ * hit. */
+ssize_t file_read(int fd, char *buf, size_t maxlen);
+
+/* A single block of file data, together with the results of analyzing it. */
+struct ReadBlock {
+    char *data;
+    size_t len;
+    bool all_zero;
+
+    // Checksum and subfile chunk signatures of the data.  These are not
+    // computed for blocks which are all zero.
+    std::string checksum;
+    std::vector<Subfile::chunk_info> chunks;
+};
+
+class ReaderPool;
+
+class FileReader {
+public:
+    // Takes ownership of fd, which is closed when the reader is destroyed.
+    // stat_buf holds the results of fstat on fd.
+    FileReader(int fd, const struct stat &stat_buf);
+
+    // Reference counting for lifetime management, as with FilePattern.  A
+    // reader queued in a ReaderPool holds an additional reference, so the
+    // consumer may drop its own reference at any time.
+    void ref();
+    void unref();
+
+    // Returns the next block of the file, or NULL at the end of the file or
+    // on a read error.  If no worker thread has started reading the file, this
+    // waits for one to pick it up, unless the file was never submitted to a
+    // pool or every worker is itself waiting on the consumer; then the block
+    // is read in the calling thread instead.  Each block returned must be
+    // handed back to release_block once the data is no longer needed.
+    ReadBlock *next_block();
+    void release_block(ReadBlock *block);
+
+    // Results for the file as a whole; valid once next_block returns NULL.
+    bool read_error();
+    std::string checksum();
+
+    // Indicate that the file contents are not needed after all, so that a
+    // worker thread reading the file can stop early.
+    void cancel();
+
+    // Find where the start of the file's data is on disk, if the file system
+    // will say (through FIEMAP), so that files can be read in disk order.
+    // Returns false if the location is not known.
+    bool physical_offset(uint64_t *offset);
+
+    // Limit on the number of blocks a worker may read ahead of the consumer.
+    static const size_t MAX_READY_BLOCKS = 2;
+
+    // Number of blocks beyond the one being read which the kernel is asked to
+    // start reading in (with posix_fadvise), so that the disk is kept busy
+    // while data already read is being hashed.
+    static const size_t READ_AHEAD_BLOCKS = 4;
+
+private:
+    friend class ReaderPool;
+    ~FileReader();
+
+    // Used by ReaderPool worker threads: claim() returns true if the calling
+    // thread should read the file, after which run() reads the entire file.
+    bool claim();
+    void run();
+
+    // Read and analyze the next block of the file, returning NULL at the end.
+    // Not synchronized; only the thread which claimed the reader may call it.
+    ReadBlock *read_block();
+
+    // Ask the kernel to start reading the file up to READ_AHEAD_BLOCKS
+    // blocks past the current position, if not already done.  The first call
+    // also marks the file as read sequentially.
+    void read_ahead();
+
+    // Like file_read, but holes in sparse files are filled in with zeroes
+    // instead of being read.  *hole is set if all of the data came from
+    // holes.
+    ssize_t read_data(char *buf, size_t maxlen, bool *hole);
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refcount;
+
+    ReaderPool *pool;           // Pool the file was submitted to, if any
+
+    int fd;
+    Hash *file_hash;
+
+    // Position of the next read, and what is known of the layout of the file
+    // around it: [offset, hole_end) is a hole, and [hole_end, data_end) is
+    // data.  For files which are not sparse, data_end is just left past the
+    // end of the file.
+    off_t offset;
+    off_t hole_end, data_end;
+
+    // Size of the file when opened, and the offset up to which read-ahead
+    // has been requested.
+    off_t file_size;
+    off_t advised_end;
+
+    // With content-defined blocks, data read past the end of the last block
+    // returned, to be used at the start of the next.
+    char *carry_buf;
+    size_t carry_len;
+
+    bool claimed;               // Set once a thread has begun reading
+    bool reading_inline;        // Claimed by the consumer, in next_block
+    bool finished;              // No more blocks will be added to ready
+    bool cancelled;
+    bool error;
+    std::list<ReadBlock *> ready;
+    std::string file_checksum;
+};
+
+/* A set of worker threads which read files submitted to it, in the order
+ * submitted. */
+class ReaderPool {
+public:
+    ReaderPool(int num_threads);
+    ~ReaderPool();
+
+    void submit(FileReader *reader);
+
+private:
+    friend class FileReader;
+
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Signalled when a worker claims a file or starts waiting on the
+    // consumer, for a consumer in wait_for_worker.
+    pthread_cond_t progress;
+    size_t stalled;             // Workers waiting for the consumer
+
+    bool terminate;             // Set when threads should shut down
+    std::list<FileReader *> queue;
+
+    // Used by FileReader: a worker reports while it is waiting for the
+    // consumer to take blocks, and the consumer waits for a file to be
+    // claimed by a worker as long as some worker is still making progress.
+    void set_stalled(bool is_stalled);
+    void wait_for_worker(FileReader *reader);
+
+    void worker_thread();
+    static void *start_worker_thread(void *arg);
+};
+
+#endif // _CUMULUS_READER_H
@@ -23,7 +23,8 @@
  * transferred to the remote server.
  *
  * Like encryption, remote storage is handled through the use of external
- * scripts that are called when a file is to be transferred. */
+ * scripts that are called when a file is to be transferred.  See remote.h for
+ * an overview. */
 
 #include <assert.h>
 #include <errno.h>
@@ -36,14 +37,17 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <list>
 #include <string>
+#include <vector>
 
 #include "remote.h"
 #include "store.h"
 #include "util.h"
 
 using std::string;
+using std::vector;
 
 static const char *backup_directories[] = {
     "meta",
@@ -53,7 +57,8 @@ static const char *backup_directories[] = {
     NULL
 };
 
-RemoteStore::RemoteStore(const string &stagedir, const string &script)
+RemoteStore::RemoteStore(const string &stagedir, const string &script,
+                         int num_threads, size_t max_staging_bytes)
 {
     staging_dir = stagedir;
     backup_script = script;
@@ -71,23 +76,39 @@ RemoteStore::RemoteStore(const string &stagedir, const string &script)
         }
     }
 
-    /* A background thread is created for each RemoteStore to manage the actual
+    /* Background threads are created for each RemoteStore to manage the actual
      * transfers to a remote server.  The main program thread can enqueue
      * RemoteFile objects to be transferred asynchronously. */
     pthread_mutex_init(&lock, NULL);
     pthread_cond_init(&cond, NULL);
     terminate = false;
-    busy = true;
+    active_transfers = 0;
+    this->max_staging_bytes = max_staging_bytes;
+    queued_bytes = 0;
+    reserved_bytes = 0;
+    peak_staging_bytes = 0;
     files_outstanding = 0;
 
-    if (pthread_create(&thread, NULL, RemoteStore::start_transfer_thread,
-                       (void *)this) != 0) {
-        fprintf(stderr, "Cannot create remote storage thread: %m\n");
-        fatal("pthread_create");
+    bytes_transferred = 0;
+    transfer_time = 0.0;
+    queue_time = 0.0;
+    start_time = monotonic_time();
+    blocked_time = 0.0;
+
+    if (num_threads < 1)
+        num_threads = 1;
+    threads.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL,
+                           RemoteStore::start_transfer_thread,
+                           (void *)this) != 0) {
+            fprintf(stderr, "Cannot create remote storage thread: %m\n");
+            fatal("pthread_create");
+        }
     }
 }
 
-/* The RemoteStore destructor will terminate the background transfer thread.
+/* The RemoteStore destructor will terminate the background transfer threads.
  * It will wait for all work to finish. */
 RemoteStore::~RemoteStore()
 {
@@ -96,8 +117,10 @@ RemoteStore::~RemoteStore()
     pthread_cond_broadcast(&cond);
     pthread_mutex_unlock(&lock);
 
-    if (pthread_join(thread, NULL) != 0) {
-        fprintf(stderr, "Warning: Unable to join storage thread: %m\n");
+    for (size_t i = 0; i < threads.size(); i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Warning: Unable to join storage thread: %m\n");
+        }
     }
 
     assert(files_outstanding == 0);
@@ -119,6 +142,49 @@ RemoteFile *RemoteStore::alloc_file(const string &name, const string &type)
                           staging_dir + "/" + type + "/" + name);
 }
 
+/* Wait until bytes more can be added to the staging directory without going
+ * over the limit, or until no transfers are pending (so that waiting would not
+ * help).  Called, and returns, with lock held. */
+void RemoteStore::wait_for_staging(size_t bytes)
+{
+    double start = monotonic_time();
+
+    while (queued_bytes > 0
+           && queued_bytes + reserved_bytes + bytes > max_staging_bytes)
+        pthread_cond_wait(&cond, &lock);
+
+    blocked_time += monotonic_time() - start;
+}
+
+/* Reserve space in the staging directory for a file about to be written,
+ * blocking if there is not room.  The reservation is released when the file
+ * is enqueued, and replaced by its actual size. */
+void RemoteStore::reserve(RemoteFile *file, size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+
+    reserved_bytes -= file->reserved;
+    file->reserved = 0;
+    wait_for_staging(bytes);
+    file->reserved = bytes;
+    reserved_bytes += bytes;
+    peak_staging_bytes = std::max(peak_staging_bytes,
+                                  queued_bytes + reserved_bytes);
+
+    pthread_mutex_unlock(&lock);
+}
+
+/* Returns true if bytes can be reserved without going over the staging limit,
+ * or if nothing is staged at all. */
+bool RemoteStore::can_reserve(size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+    bool result = (queued_bytes == 0 && reserved_bytes == 0)
+                  || queued_bytes + reserved_bytes + bytes <= max_staging_bytes;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
 /* Request that a file be transferred to the remote server.  The actual
  * transfer will happen asynchronously in another thread.  The call to enqueue
  * may block, however, if there is a backlog of data to be transferred.
@@ -126,14 +192,24 @@ RemoteFile *RemoteStore::alloc_file(const string &name, const string &type)
  * responsible for its destruction. */
 void RemoteStore::enqueue(RemoteFile *file)
 {
+    struct stat stat_buf;
+    if (stat(file->local_path.c_str(), &stat_buf) == 0)
+        file->size = stat_buf.st_size;
+    else
+        file->size = 0;
+
     pthread_mutex_lock(&lock);
 
-    while (transfer_queue.size() >= MAX_QUEUE_SIZE)
-        pthread_cond_wait(&cond, &lock);
+    reserved_bytes -= file->reserved;
+    file->reserved = 0;
+    wait_for_staging(file->size);
 
+    file->queued_at = monotonic_time();
     transfer_queue.push_back(file);
+    queued_bytes += file->size;
+    peak_staging_bytes = std::max(peak_staging_bytes,
+                                  queued_bytes + reserved_bytes);
     files_outstanding--;
-    busy = true;
 
     pthread_cond_broadcast(&cond);
     pthread_mutex_unlock(&lock);
@@ -142,10 +218,47 @@ void RemoteStore::enqueue(RemoteFile *file)
 /* Wait for all transfers to finish. */
 void RemoteStore::sync()
 {
+    double start = monotonic_time();
+
     pthread_mutex_lock(&lock);
 
-    while (busy)
+    while (!transfer_queue.empty() || active_transfers > 0)
         pthread_cond_wait(&cond, &lock);
+    blocked_time += monotonic_time() - start;
+
+    pthread_mutex_unlock(&lock);
+}
+
+void RemoteStore::dump_stats()
+{
+    pthread_mutex_lock(&lock);
+
+    if (!latencies.empty()) {
+        vector<double> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+
+        printf("Uploads:\n");
+        printf("    files: %zd (%lld bytes, %zd threads)\n",
+               n, (long long)bytes_transferred, threads.size());
+        printf("    latency: %.3f s mean, %.3f s median, %.3f s 95th "
+               "percentile, %.3f s max\n",
+               transfer_time / n, sorted[n / 2], sorted[n * 95 / 100],
+               sorted[n - 1]);
+        printf("    throughput: %.1f MB/s per thread\n",
+               transfer_time > 0 ? bytes_transferred / transfer_time / 1e6
+                                 : 0.0);
+        printf("    time queued: %.3f s total\n", queue_time);
+    }
+
+    if (backup_script != "") {
+        double elapsed = monotonic_time() - start_time;
+        printf("Staging:\n");
+        printf("    peak usage: %lld bytes (limit %lld)\n",
+               (long long)peak_staging_bytes, (long long)max_staging_bytes);
+        printf("    time producing data: %.3f s; blocked on uploads: "
+               "%.3f s\n", elapsed - blocked_time, blocked_time);
+    }
 
     pthread_mutex_unlock(&lock);
 }
@@ -162,17 +275,19 @@ void RemoteStore::transfer_thread()
 {
     /* If a transfer script was specified, launch it and connect to both stdin
      * and stdout.  fd_in is stdin of the child, and fd_out is stdout for the
-     * child. */
+     * child.  The pipes are created close-on-exec, since another transfer
+     * thread may be starting its own script concurrently and must not inherit
+     * them. */
     pid_t pid = 0;
     FILE *fd_in = NULL, *fd_out = NULL;
 
     if (backup_script != "") {
         int fds[4];
 
-        if (pipe(&fds[0]) < 0) {
+        if (pipe2(&fds[0], O_CLOEXEC) < 0) {
             fatal("Unable to create pipe for upload script");
         }
-        if (pipe(&fds[2]) < 0) {
+        if (pipe2(&fds[2], O_CLOEXEC) < 0) {
             fatal("Unable to create pipe for upload script");
         }
 
@@ -186,8 +301,8 @@ void RemoteStore::transfer_thread()
             /* Parent */
             close(fds[0]);
             close(fds[3]);
-            cloexec(fds[1]); fd_in = fdopen(fds[1], "w");
-            cloexec(fds[2]); fd_out = fdopen(fds[2], "r");
+            fd_in = fdopen(fds[1], "w");
+            fd_out = fdopen(fds[2], "r");
         } else if (pid == 0) {
             /* Child */
             if (dup2(fds[0], 0) < 0)
@@ -207,21 +322,17 @@ void RemoteStore::transfer_thread()
 
         // Wait for a file to transfer
         pthread_mutex_lock(&lock);
-        while (transfer_queue.empty() && !terminate) {
-            busy = false;
-            pthread_cond_broadcast(&cond);
+        while (transfer_queue.empty() && !terminate)
             pthread_cond_wait(&cond, &lock);
-        }
-        if (terminate && transfer_queue.empty()) {
-            busy = false;
-            pthread_cond_broadcast(&cond);
+        if (transfer_queue.empty()) {
             pthread_mutex_unlock(&lock);
             break;
         }
-        busy = true;
         file = transfer_queue.front();
         transfer_queue.pop_front();
-        pthread_cond_broadcast(&cond);
+        active_transfers++;
+        double start = monotonic_time();
+        queue_time += start - file->queued_at;
         pthread_mutex_unlock(&lock);
 
         // Transfer the file
@@ -242,6 +353,7 @@ void RemoteStore::transfer_thread()
                 *strchr(resp, '\n') = '\0';
             if (strcmp(resp, "OK") != 0)
                 fatal("error response from upload script");
+            free(resp);
 
             if (unlink(file->local_path.c_str()) < 0) {
                 fprintf(stderr, "Warning: Deleting temporary file %s: %m\n",
@@ -249,6 +361,18 @@ void RemoteStore::transfer_thread()
             }
         }
 
+        pthread_mutex_lock(&lock);
+        if (backup_script != "") {
+            double latency = monotonic_time() - start;
+            latencies.push_back(latency);
+            transfer_time += latency;
+            bytes_transferred += file->size;
+        }
+        active_transfers--;
+        queued_bytes -= file->size;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
         delete file;
     }
 
@@ -274,6 +398,9 @@ RemoteFile::RemoteFile(RemoteStore *remote,
     this->type = type;
     this->local_path = local_path;
     this->remote_path = type + "/" + name;
+    size = 0;
+    reserved = 0;
+    queued_at = 0.0;
 
     fd = open(local_path.c_str(), O_WRONLY | O_CREAT, 0666);
     if (fd < 0)
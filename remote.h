@@ -23,42 +23,87 @@
  * transferred to the remote server.
  *
  * Like encryption, remote storage is handled through the use of external
- * scripts that are called when a file is to be transferred. */
+ * scripts that are called when a file is to be transferred.  Several
+ * transfers may run at once: each transfer thread starts its own copy of the
+ * upload script, and so the script must cope with concurrent invocations.
+ *
+ * The space used by files in the staging directory is limited to a fixed
+ * number of bytes.  Writers of large files (segments) reserve an estimate of
+ * the space needed before writing, and both reserving space and queueing a
+ * file block while the staging directory is over its limit, until uploads
+ * have made room.  Waiting only helps while uploads are pending, so a writer
+ * holding reservations for several files should first check can_reserve(),
+ * and if it fails, finish and queue those files before reserving more. */
 
 #ifndef _LBS_REMOTE_H
 #define _LBS_REMOTE_H
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include <list>
 #include <string>
-#include <pthread.h>
+#include <vector>
 
 class RemoteFile;
 
 class RemoteStore {
 public:
-    static const size_t MAX_QUEUE_SIZE = 4;
+    // Default limit on the size of files in the staging directory.
+    static const size_t DEFAULT_STAGING_BYTES = 64 << 20;
 
-    RemoteStore(const std::string &stagedir, const std::string &script = "");
+    RemoteStore(const std::string &stagedir, const std::string &script = "",
+                int num_threads = 1,
+                size_t max_staging_bytes = DEFAULT_STAGING_BYTES);
     ~RemoteStore();
     RemoteFile *alloc_file(const std::string &name, const std::string &type);
+    void reserve(RemoteFile *file, size_t bytes);
+    bool can_reserve(size_t bytes);
     void enqueue(RemoteFile *file);
     void sync();
 
+    // Print statistics about completed transfers to stdout.
+    void dump_stats();
+
 private:
-    pthread_t thread;
+    std::vector<pthread_t> threads;
     pthread_mutex_t lock;
     pthread_cond_t cond;
 
     std::string staging_dir, backup_script;
-    bool terminate;             // Set when thread should shut down
-    bool busy;                  // True while there are pending transfers
+    bool terminate;             // Set when threads should shut down
+    int active_transfers;       // Number of files currently being sent
     std::list<RemoteFile *> transfer_queue;
 
+    /* Staging space in use: queued_bytes is the total size of the files
+     * queued or being transferred, and reserved_bytes the space reserved for
+     * files still being written.  Callers block while their file would take
+     * the sum over max_staging_bytes, but only while there are transfers
+     * pending which will free space. */
+    size_t max_staging_bytes;
+    size_t queued_bytes;
+    size_t reserved_bytes;
+    size_t peak_staging_bytes;
+
+    void wait_for_staging(size_t bytes);
+
     /* For error-checking purposes, track the number of files which have been
      * allocated but not yet queued to be sent.  This should be zero when the
      * RemoteStore is destroyed. */
     int files_outstanding;
 
+    // Statistics, protected by lock.  Latencies are in seconds, measured
+    // from the start of the transfer to the response from the script.
+    std::vector<double> latencies;
+    int64_t bytes_transferred;
+    double transfer_time;       // Sum of all transfer latencies
+    double queue_time;          // Time files waited in the queue
+
+    // Time spent by the writer of the backup producing data, versus waiting
+    // for uploads to make room in the staging directory or to finish.
+    double start_time;
+    double blocked_time;
+
     void transfer_thread();
     static void *start_transfer_thread(void *arg);
 };
@@ -73,6 +118,10 @@ public:
     const std::string &get_local_path() const { return local_path; }
     const std::string &get_remote_path() const { return remote_path; }
 
+    /* Reserve an estimate of the space the file will take in the staging
+     * directory, before writing it.  This may block; see RemoteStore. */
+    void reserve(size_t bytes) { remote_store->reserve(this, bytes); }
+
     /* Called when the file is finished--request that it be sent to the remote
      * server.  This will delete the RemoteFile object. */
     void send() { remote_store->enqueue(this); }
@@ -88,6 +137,10 @@ private:
     int fd;
     std::string type, local_path;
     std::string remote_path;
+
+    size_t size;                // File size, once queued for transfer
+    size_t reserved;            // Staging space reserved while writing
+    double queued_at;           // Time at which the file was queued
 };
 
 #endif // _LBS_REMOTE_H
@@ -23,7 +23,7 @@ create table schema_version(
     major integer,              -- Major version number
     minor integer               -- Minor version number
 );
-insert into schema_version values ('0.11', 0, 11);
+insert into schema_version values ('0.13', 0, 13);
 
 -- List of snapshots which have been created and which we are still tracking.
 -- There may be more snapshots than this actually stored at the remote server,
@@ -49,13 +49,22 @@ create table segments (
 );
 create unique index segment_name_index on segments(segment);
 
+-- Checksum algorithms used for blocks in block_index.  Block checksums are
+-- stored in binary form: the algorithm name (such as "sha224") is replaced by
+-- its id from this table, and the hex digest by the raw digest bytes.
+create table checksum_algorithms (
+    algorithmid integer primary key,
+    name text unique not null
+);
+
 -- Index of all data blocks in stored segments.  This is indexed by content
 -- hash to allow for coarse block-level data deduplication.
 create table block_index (
     blockid integer primary key,
     segmentid integer not null,
     object text not null,
-    checksum text,
+    algorithmid integer,        -- checksum algorithm, from checksum_algorithms
+    checksum blob,              -- binary digest of the block contents
     size integer,
     timestamp datetime,         -- when a block with this data was first stored
     expired integer
@@ -84,6 +93,26 @@ create table subblock_signatures (
     signatures blob not null
 );
 
+-- Index of the contents of recently backed-up files, by inode.  A file which
+-- has been moved or renamed (and so is not found by path in the statcache) can
+-- be recognized from its inode number, size, and modification time without
+-- being read.  A file which has been touched, or only partly changed, is still
+-- read, but its blocks are compared against those listed here instead of each
+-- being looked up in block_index.  Only files of at least one block (1 MB) are
+-- indexed.
+--
+-- blocks holds one line per block of the file: the block checksum (or "zero"
+-- for a block of all zeroes) followed by the object references for the block,
+-- separated by spaces.
+create table file_index (
+    inode text primary key,     -- "major/minor/inode", as in the metadata log
+    size integer not null,
+    mtime integer not null,
+    checksum text not null,     -- whole-file checksum
+    blocks text not null,
+    snapshotid integer not null -- latest snapshot which included the file
+);
+
 -- Summary of segment utilization for each snapshot.
 create table segment_utilization (
     snapshotid integer not null,
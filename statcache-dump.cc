@@ -0,0 +1,45 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Small utility program for debugging: prints out the contents of a binary
+ * statcache in the text format used by older versions (an "@@" line giving the
+ * location of the metadata in the snapshot, followed by the metadata itself).
+ *
+ * Usage: cumulus-statcache-dump STATCACHE */
+
+#include <stdio.h>
+
+#include "statcache.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s STATCACHE\n", argv[0]);
+        return 1;
+    }
+
+    StatcacheReader reader(argv[1]);
+    if (!reader.valid()) {
+        fprintf(stderr, "Unable to read statcache %s\n", argv[1]);
+        return 1;
+    }
+    reader.export_text(stdout);
+
+    return 0;
+}
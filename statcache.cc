@@ -0,0 +1,535 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reading and writing of the binary statcache.  See statcache.h for a
+ * description of the format. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "ref.h"
+#include "statcache.h"
+#include "util.h"
+
+using std::list;
+using std::map;
+using std::string;
+
+/* Like strcmp, but sorts in the order that files will be visited in the
+ * filesystem.  That is, we break paths apart at slashes, and compare path
+ * components separately. */
+static int pathcmp(const char *path1, const char *path2)
+{
+    /* Find the first component in each path. */
+    const char *slash1 = strchr(path1, '/');
+    const char *slash2 = strchr(path2, '/');
+
+    {
+        string comp1, comp2;
+        if (slash1 == NULL)
+            comp1 = path1;
+        else
+            comp1 = string(path1, slash1 - path1);
+
+        if (slash2 == NULL)
+            comp2 = path2;
+        else
+            comp2 = string(path2, slash2 - path2);
+
+        /* Directly compare the two components first. */
+        if (comp1 < comp2)
+            return -1;
+        if (comp1 > comp2)
+            return 1;
+    }
+
+    if (slash1 == NULL && slash2 == NULL)
+        return 0;
+    if (slash1 == NULL)
+        return -1;
+    if (slash2 == NULL)
+        return 1;
+
+    return pathcmp(slash1 + 1, slash2 + 1);
+}
+
+StatcacheReader::StatcacheReader(const string &path)
+{
+    map = NULL;
+    map_size = 0;
+    header = NULL;
+    records = NULL;
+    num_records = 0;
+    position = 0;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Warning: Unable to open statcache %s: %m\n",
+                    path.c_str());
+        return;
+    }
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) < 0 || stat_buf.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void *p = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Warning: Unable to map statcache %s: %m\n",
+                path.c_str());
+        return;
+    }
+    map = (const char *)p;
+    map_size = stat_buf.st_size;
+
+    /* Check that the header is sane and the tables lie within the file before
+     * using them; a damaged statcache is treated as empty. */
+    const StatcacheHeader *h = (const StatcacheHeader *)map;
+    bool valid = map_size >= sizeof(StatcacheHeader)
+        && memcmp(h->magic, STATCACHE_MAGIC, sizeof(h->magic)) == 0
+        && h->version == STATCACHE_VERSION
+        && h->file_size == map_size
+        && h->records_offset % 8 == 0
+        && h->records_offset <= map_size
+        && h->num_records <= (map_size - h->records_offset)
+                                / sizeof(StatcacheRecord)
+        && h->segments_offset % 8 == 0
+        && h->segments_offset <= map_size
+        && h->num_segments <= (map_size - h->segments_offset)
+                                / sizeof(StatcacheString);
+    if (!valid) {
+        fprintf(stderr, "Warning: Ignoring invalid statcache %s\n",
+                path.c_str());
+        return;
+    }
+
+    header = h;
+    records = (const StatcacheRecord *)(map + header->records_offset);
+    num_records = header->num_records;
+}
+
+StatcacheReader::~StatcacheReader()
+{
+    if (map != NULL)
+        munmap((void *)map, map_size);
+}
+
+/* Return a pointer to a string stored in the statcache, and optionally its
+ * length (the string may contain NUL bytes).  Strings which do not lie within
+ * the file are returned as empty. */
+const char *StatcacheReader::get_string(const StatcacheString &s,
+                                        size_t *length) const
+{
+    if (s.offset >= map_size || s.length >= map_size - s.offset
+        || map[s.offset + s.length] != '\0') {
+        if (length != NULL)
+            *length = 0;
+        return "";
+    }
+    if (length != NULL)
+        *length = s.length;
+    return map + s.offset;
+}
+
+const char *StatcacheReader::segment_name(uint32_t segment) const
+{
+    if (header == NULL || segment >= header->num_segments)
+        return "";
+    const StatcacheString *segments
+        = (const StatcacheString *)(map + header->segments_offset);
+    return get_string(segments[segment]);
+}
+
+bool StatcacheReader::find(const string& path)
+{
+    const char *path_str = path.c_str();
+    while (position < num_records) {
+        int cmp = pathcmp(get_string(records[position].name), path_str);
+        if (cmp == 0)
+            return true;
+        else if (cmp > 0)
+            return false;
+        else
+            position++;
+    }
+
+    return false;
+}
+
+ObjectReference StatcacheReader::old_ref() const
+{
+    const StatcacheRecord *r = current();
+    if (r == NULL)
+        return ObjectReference();
+    return ObjectReference::parse(get_string(r->location));
+}
+
+/* Does a file appear to be unchanged from the previous time it was backed up,
+ * based on stat information? */
+bool StatcacheReader::is_unchanged(const struct stat *stat_buf) const
+{
+    const StatcacheRecord *r = current();
+    if (r == NULL)
+        return false;
+
+    const uint32_t required = STATCACHE_HAS_CTIME | STATCACHE_HAS_MTIME
+        | STATCACHE_HAS_SIZE | STATCACHE_HAS_INODE;
+    if ((r->flags & (required | STATCACHE_VOLATILE)) != required)
+        return false;
+
+    return stat_buf->st_ctime == r->ctime
+        && stat_buf->st_mtime == r->mtime
+        && stat_buf->st_size == r->size
+        && stat_buf->st_ino == r->ino
+        && major(stat_buf->st_dev) == r->dev_major
+        && minor(stat_buf->st_dev) == r->dev_minor;
+}
+
+bool StatcacheReader::matches(const string &text) const
+{
+    const StatcacheRecord *r = current();
+    if (r == NULL)
+        return false;
+
+    size_t length;
+    const char *old_text = get_string(r->text, &length);
+    return length == text.size()
+        && memcmp(old_text, text.data(), length) == 0;
+}
+
+list<ObjectReference> StatcacheReader::get_blocks() const
+{
+    list<ObjectReference> blocks;
+
+    const StatcacheRecord *r = current();
+    if (r == NULL)
+        return blocks;
+
+    size_t length;
+    const char *p = get_string(r->blocks, &length);
+    const char *end = p + length;
+    while (end - p >= 8) {
+        uint32_t segment, ref_length;
+        memcpy(&segment, p, 4);
+        memcpy(&ref_length, p + 4, 4);
+        p += 8;
+        if (ref_length > (size_t)(end - p))
+            break;
+
+        string ref;
+        if (segment != NO_SEGMENT)
+            ref = segment_name(segment);
+        ref.append(p, ref_length);
+        p += ref_length;
+
+        ObjectReference o = ObjectReference::parse(ref);
+        if (!o.is_null())
+            blocks.push_back(o);
+    }
+
+    return blocks;
+}
+
+string StatcacheReader::get_checksum() const
+{
+    const StatcacheRecord *r = current();
+    if (r == NULL)
+        return "";
+    return get_string(r->checksum);
+}
+
+void StatcacheReader::export_text(FILE *out) const
+{
+    for (uint64_t i = 0; i < num_records; i++) {
+        size_t length;
+        const char *text = get_string(records[i].text, &length);
+        fprintf(out, "@@%s\n", get_string(records[i].location));
+        fwrite(text, 1, length, out);
+    }
+}
+
+StatcacheWriter::StatcacheWriter(const string &path)
+    : path(path), records_path(path + ".records")
+{
+    out = fopen(path.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening statcache %s: %m\n", path.c_str());
+        fatal("Error opening statcache");
+    }
+
+    records_out = fopen(records_path.c_str(), "w+");
+    if (records_out == NULL) {
+        fprintf(stderr, "Error opening statcache %s: %m\n",
+                records_path.c_str());
+        fatal("Error opening statcache");
+    }
+    unlink(records_path.c_str());
+
+    /* Space for the header is reserved now and filled in by close(). */
+    StatcacheHeader header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+    offset = sizeof(header);
+    num_records = 0;
+}
+
+StatcacheWriter::~StatcacheWriter()
+{
+    if (out != NULL)
+        fclose(out);
+    if (records_out != NULL)
+        fclose(records_out);
+}
+
+/* Append a string, with a terminating NUL, to the string data. */
+StatcacheString StatcacheWriter::add_string(const string &s)
+{
+    StatcacheString result;
+    result.offset = offset;
+    result.length = s.size();
+
+    fwrite(s.c_str(), 1, s.size() + 1, out);
+    offset += s.size() + 1;
+
+    return result;
+}
+
+uint32_t StatcacheWriter::intern_segment(const string &segment)
+{
+    map<string, uint32_t>::iterator i = segment_ids.find(segment);
+    if (i != segment_ids.end())
+        return i->second;
+
+    uint32_t id = segment_names.size();
+    segment_ids[segment] = id;
+    segment_names.push_back(add_string(segment));
+    return id;
+}
+
+void StatcacheWriter::add(const string &location, const dictionary &info,
+                          const string &text)
+{
+    StatcacheRecord record;
+    memset(&record, 0, sizeof(record));
+
+    dictionary::const_iterator i;
+    if ((i = info.find("name")) != info.end())
+        record.name = add_string(uri_decode(i->second));
+    else
+        record.name = add_string("");
+    record.location = add_string(location);
+    record.text = add_string(text);
+    if ((i = info.find("checksum")) != info.end())
+        record.checksum = add_string(i->second);
+    else
+        record.checksum = add_string("");
+
+    if ((i = info.find("ctime")) != info.end()) {
+        record.ctime = parse_int(i->second);
+        record.flags |= STATCACHE_HAS_CTIME;
+    }
+    if ((i = info.find("mtime")) != info.end()) {
+        record.mtime = parse_int(i->second);
+        record.flags |= STATCACHE_HAS_MTIME;
+    }
+    if ((i = info.find("size")) != info.end()) {
+        record.size = parse_int(i->second);
+        record.flags |= STATCACHE_HAS_SIZE;
+    }
+    if ((i = info.find("inode")) != info.end()) {
+        unsigned int dev_major, dev_minor;
+        unsigned long long ino;
+        int n;
+        if (sscanf(i->second.c_str(), "%u/%u/%llu%n",
+                   &dev_major, &dev_minor, &ino, &n) == 3
+            && i->second[n] == '\0') {
+            record.dev_major = dev_major;
+            record.dev_minor = dev_minor;
+            record.ino = ino;
+            record.flags |= STATCACHE_HAS_INODE;
+        }
+    }
+    if ((i = info.find("volatile")) != info.end()
+        && parse_int(i->second) != 0)
+        record.flags |= STATCACHE_VOLATILE;
+
+    /* Pack the list of blocks, with the segment names replaced by indices
+     * into the table of segments. */
+    string blocks;
+    if ((i = info.find("data")) != info.end()) {
+        const char *s = i->second.c_str();
+        while (*s != '\0') {
+            if (isspace(*s)) {
+                s++;
+                continue;
+            }
+
+            const char *start = s;
+            while (*s != '\0' && !isspace(*s))
+                s++;
+            string ref(start, s - start);
+
+            uint32_t segment = NO_SEGMENT;
+            size_t slash = ref.find('/');
+            if (slash != string::npos && slash > 0) {
+                segment = intern_segment(ref.substr(0, slash));
+                ref = ref.substr(slash);
+            }
+
+            uint32_t length = ref.size();
+            blocks.append((const char *)&segment, 4);
+            blocks.append((const char *)&length, 4);
+            blocks += ref;
+        }
+    }
+    record.blocks = add_string(blocks);
+
+    fwrite(&record, sizeof(record), 1, records_out);
+    num_records++;
+}
+
+void StatcacheWriter::close()
+{
+    StatcacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATCACHE_MAGIC, sizeof(header.magic));
+    header.version = STATCACHE_VERSION;
+
+    /* Pad the string data so the tables which follow are aligned. */
+    static const char padding[8] = {0};
+    fwrite(padding, 1, (8 - offset % 8) % 8, out);
+    offset += (8 - offset % 8) % 8;
+
+    header.records_offset = offset;
+    header.num_records = num_records;
+    rewind(records_out);
+    char buf[65536];
+    size_t bytes;
+    while ((bytes = fread(buf, 1, sizeof(buf), records_out)) > 0)
+        fwrite(buf, 1, bytes, out);
+    offset += num_records * sizeof(StatcacheRecord);
+    fclose(records_out);
+    records_out = NULL;
+
+    header.segments_offset = offset;
+    header.num_segments = segment_names.size();
+    for (list<StatcacheString>::iterator i = segment_names.begin();
+         i != segment_names.end(); ++i) {
+        fwrite(&*i, sizeof(*i), 1, out);
+        offset += sizeof(*i);
+    }
+
+    header.file_size = offset;
+    rewind(out);
+    fwrite(&header, sizeof(header), 1, out);
+
+    if (ferror(out)) {
+        fprintf(stderr, "Error writing statcache %s\n", path.c_str());
+        fatal("Error writing statcache");
+    }
+    fclose(out);
+    out = NULL;
+}
+
+/* Read the text statcache written by older versions: each entry is a line
+ * "@@location" followed by the metadata as "key: value" lines, with
+ * continuation lines starting with whitespace, and ends with a blank line. */
+bool statcache_convert(const string &text_path, const string &path)
+{
+    FILE *in = fopen(text_path.c_str(), "r");
+    if (in == NULL)
+        return false;
+
+    string tmp_path = path + ".convert";
+    StatcacheWriter *writer = new StatcacheWriter(tmp_path);
+
+    char *buf = NULL;
+    size_t n = 0;
+    while (getline(&buf, &n, in) >= 0) {
+        if (buf[0] != '@' || buf[1] != '@')
+            break;
+        if (strchr(buf, '\n') != NULL)
+            *strchr(buf, '\n') = '\0';
+        string location = buf + 2;
+
+        dictionary info;
+        string text = "";
+        string field = "";          // Last field to be read in
+        while (getline(&buf, &n, in) >= 0) {
+            text += buf;
+
+            char *eol = strchr(buf, '\n');
+            if (eol != NULL)
+                *eol = '\0';
+
+            if (buf[0] == '\0')
+                break;
+
+            if (isspace(buf[0]) && field != "") {
+                info[field] += string("\n") + buf;
+                continue;
+            }
+
+            char *value = strchr(buf, ':');
+            if (value == NULL)
+                continue;
+            *value = '\0';
+            field = buf;
+
+            value++;
+            while (isspace(*value))
+                value++;
+
+            info[field] = value;
+        }
+
+        writer->add(location, info, text);
+    }
+    free(buf);
+    fclose(in);
+
+    writer->close();
+    delete writer;
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        fprintf(stderr, "Error renaming statcache from %s to %s: %m\n",
+                tmp_path.c_str(), path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,177 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The statcache: a local record of the metadata of each file in the previous
+ * backup, used to tell which files are unchanged and can be dumped without
+ * reading them, and which metadata can be reused from the old snapshot.
+ *
+ * The statcache is stored in a binary format which can be used directly
+ * through mmap, without parsing:
+ *
+ *   StatcacheHeader
+ *   string data: paths, metadata text, checksums, and block lists
+ *   StatcacheRecord for each file, in the order visited
+ *   string offsets of the interned segment names
+ *
+ * Integers are stored in host byte order, since the statcache never leaves
+ * the machine which wrote it.  Strings are referenced by offset from the start
+ * of the file and length, and are also NUL-terminated.  A block list is a
+ * sequence of (segment index, length, text) entries, the text being the rest
+ * of the object reference after the segment name; references without a
+ * segment (such as to the zero object) use NO_SEGMENT and the full text.
+ *
+ * Older versions of Cumulus wrote a text statcache (statcache2), with the
+ * same content as the metadata log.  It is converted the first time it is
+ * found, and StatcacheReader::export_text writes out the same format for
+ * debugging.
+ */
+
+#ifndef _CUMULUS_STATCACHE_H
+#define _CUMULUS_STATCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "ref.h"
+#include "store.h"
+
+static const char STATCACHE_MAGIC[8] = "CUMSTAT";
+static const uint32_t STATCACHE_VERSION = 1;
+
+struct StatcacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_segments;
+    uint64_t num_records;
+    uint64_t records_offset;
+    uint64_t segments_offset;
+    uint64_t file_size;         // For detecting a truncated file
+};
+
+struct StatcacheString {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct StatcacheRecord {
+    StatcacheString name;       // Path (decoded), for finding the entry
+    StatcacheString location;   // Reference to the metadata in the snapshot
+    StatcacheString text;       // Metadata, as written to the metadata log
+    StatcacheString checksum;
+    StatcacheString blocks;
+    int64_t ctime, mtime, size;
+    uint64_t ino;
+    uint32_t dev_major, dev_minor;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Bits in StatcacheRecord.flags: which of the stat fields were present in the
+// metadata, and whether the file was marked volatile.
+enum {
+    STATCACHE_HAS_CTIME = 1 << 0,
+    STATCACHE_HAS_MTIME = 1 << 1,
+    STATCACHE_HAS_SIZE = 1 << 2,
+    STATCACHE_HAS_INODE = 1 << 3,
+    STATCACHE_VOLATILE = 1 << 4,
+};
+
+static const uint32_t NO_SEGMENT = 0xffffffff;
+
+/* Sequential reader for the statcache written out by a previous backup.
+ * Entries are stored in the order in which files are visited, so lookups via
+ * find() must be made in that same order.  More than one reader may be open
+ * on the same statcache at once (each keeps its own position). */
+class StatcacheReader {
+public:
+    StatcacheReader(const std::string &path);
+    ~StatcacheReader();
+
+    // Was a statcache successfully opened?  If not, the reader acts as if it
+    // were empty.
+    bool valid() const { return header != NULL; }
+
+    // Advance to the entry for path, returning true if it exists.  The
+    // accessors below then refer to that entry.
+    bool find(const std::string& path);
+    ObjectReference old_ref() const;
+
+    bool is_unchanged(const struct stat *stat_buf) const;
+
+    // Is the metadata text for the entry exactly text?
+    bool matches(const std::string &text) const;
+
+    std::list<ObjectReference> get_blocks() const;
+    std::string get_checksum() const;
+
+    // Write out all entries in the text format of statcache2.
+    void export_text(FILE *out) const;
+
+private:
+    const char *map;
+    size_t map_size;
+    const StatcacheHeader *header;
+    const StatcacheRecord *records;
+    uint64_t num_records;
+
+    uint64_t position;          // Index of the current entry
+    const StatcacheRecord *current() const {
+        return position < num_records ? &records[position] : NULL;
+    }
+
+    const char *get_string(const StatcacheString &s,
+                           size_t *length = NULL) const;
+    const char *segment_name(uint32_t segment) const;
+};
+
+class StatcacheWriter {
+public:
+    // The statcache is written to path; records are collected in a separate
+    // file alongside it until close().
+    StatcacheWriter(const std::string &path);
+    ~StatcacheWriter();
+
+    void add(const std::string &location, const dictionary &info,
+             const std::string &text);
+    void close();
+
+private:
+    std::string path, records_path;
+    FILE *out, *records_out;
+    uint64_t offset;            // Current end of the string data
+    uint64_t num_records;
+
+    std::map<std::string, uint32_t> segment_ids;
+    std::list<StatcacheString> segment_names;
+
+    StatcacheString add_string(const std::string &s);
+    uint32_t intern_segment(const std::string &segment);
+};
+
+/* Convert a text statcache, as written by older versions, to the binary
+ * format.  Returns false if it could not be read. */
+bool statcache_convert(const std::string &text_path,
+                       const std::string &path);
+
+#endif // _CUMULUS_STATCACHE_H
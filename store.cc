@@ -26,7 +26,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -56,18 +55,15 @@ using std::string;
 /* Default filter program is bzip2 */
 const char *filter_program = "bzip2 -c";
 const char *filter_extension = ".bz2";
+string segment_codec = "";
 
-Tarfile::Tarfile(RemoteFile *file, const string &segment)
-    : size(0),
-      segment_name(segment)
+Tarfile::Tarfile(const string &segment)
+    : segment_name(segment)
 {
     assert(sizeof(struct tar_header) == TAR_BLOCK_SIZE);
-
-    this->file = file;
-    this->filter.reset(FileFilter::New(file->get_fd(), filter_program));
 }
 
-Tarfile::~Tarfile()
+void Tarfile::finish(string *contents)
 {
     char buf[TAR_BLOCK_SIZE];
 
@@ -76,13 +72,8 @@ Tarfile::~Tarfile()
     tar_write(buf, TAR_BLOCK_SIZE);
     tar_write(buf, TAR_BLOCK_SIZE);
 
-    if (close(filter->get_wrapped_fd()) != 0)
-        fatal("Error closing Tarfile");
-
-    /* ...and wait for filter process to finish. */
-    if (filter->wait() != 0) {
-        fatal("Filter process error");
-    }
+    contents->swap(data);
+    data.clear();
 }
 
 FileFilter::FileFilter(int raw, int wrapped, pid_t pid)
@@ -131,8 +122,11 @@ int FileFilter::spawn_filter(int fd_out, const char *program, pid_t *filter_pid)
     int fds[2];
     pid_t pid;
 
-    /* Create a pipe for communicating with the filter process. */
-    if (pipe(fds) < 0) {
+    /* Create a pipe for communicating with the filter process.  Both ends are
+     * close-on-exec (dup2 clears the flag for the child's stdin), so that
+     * filter processes started concurrently from other threads do not
+     * inherit the pipe and hold it open. */
+    if (pipe2(fds, O_CLOEXEC) < 0) {
         fatal("Unable to create pipe for filter");
     }
 
@@ -144,7 +138,6 @@ int FileFilter::spawn_filter(int fd_out, const char *program, pid_t *filter_pid)
     if (pid > 0) {
         /* Parent process */
         close(fds[0]);
-        cloexec(fds[1]);
         if (filter_pid != NULL)
             *filter_pid = pid;
     } else {
@@ -173,21 +166,7 @@ int FileFilter::spawn_filter(int fd_out, const char *program, pid_t *filter_pid)
 
 void Tarfile::tar_write(const char *data, size_t len)
 {
-    size += len;
-
-    while (len > 0) {
-        int res = write(filter->get_wrapped_fd(), data, len);
-
-        if (res < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "Write error: %m\n");
-            fatal("Write error");
-        }
-
-        len -= res;
-        data += res;
-    }
+    this->data.append(data, len);
 }
 
 void Tarfile::write_object(int id, const char *data, size_t len)
@@ -232,31 +211,49 @@ void Tarfile::write_object(int id, const char *data, size_t len)
     tar_write(padbuf, padding);
 }
 
-/* Estimate the size based on the size of the actual output file on disk.
- * However, it might be the case that the filter program is buffering all its
- * data, and might potentially not write a single byte until we have closed
- * our end of the pipe.  If we don't do so until we see data written, we have
- * a problem.  So, arbitrarily pick an upper bound on the compression ratio
- * that the filter will achieve (128:1), and return a size estimate which is
- * the larger of a) bytes actually seen written to disk, and b) input
- * bytes/128. */
-size_t Tarfile::size_estimate()
-{
-    struct stat statbuf;
-
-    if (fstat(filter->get_raw_fd(), &statbuf) == 0)
-        return max((int64_t)statbuf.st_size, (int64_t)(size / 128));
+static const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
 
-    /* Couldn't stat the file on disk, so just return the actual number of
-     * bytes, before compression. */
-    return size;
-}
+/* Upper bound on the compression ratio assumed when estimating segment sizes.
+ * This also bounds the memory used to hold a segment before it is compressed
+ * to MAX_COMPRESSION_RATIO * SEGMENT_SIZE. */
+static const int MAX_COMPRESSION_RATIO = 16;
 
-static const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+/* Number of closed segments which may wait for a free compression thread
+ * before write_object blocks until one has been compressed. */
+static const size_t MAX_QUEUED_SEGMENTS = 2;
 
 /* Backup size summary: segment type -> (uncompressed size, compressed size) */
 static map<string, pair<int64_t, int64_t> > group_sizes;
 
+TarSegmentStore::TarSegmentStore(RemoteStore *remote, LocalDb *db,
+                                 int compression_threads)
+    : compressor(new CompressionPool(compression_threads))
+{
+    this->remote = remote;
+    this->db = db;
+}
+
+TarSegmentStore::~TarSegmentStore()
+{
+    sync();
+}
+
+/* Segments are compressed only once complete, so the size of the compressed
+ * output is not known while a segment is being filled.  Predict it from the
+ * compression achieved on earlier segments in the same group (assuming no
+ * compression until one has finished), but never assume a compression ratio
+ * better than MAX_COMPRESSION_RATIO. */
+size_t TarSegmentStore::size_estimate(const struct segment_info *segment)
+{
+    size_t size = segment->file->size();
+    const pair<int64_t, int64_t> &stats = compression_stats[segment->group];
+
+    size_t estimate = size;
+    if (stats.first > 0)
+        estimate = (size_t)((double)size * stats.second / stats.first);
+    return max(estimate, size / MAX_COMPRESSION_RATIO);
+}
+
 ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
                                               const std::string &group,
                                               const std::string &checksum,
@@ -278,7 +275,7 @@ ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
         segment->rf = remote->alloc_file(segment->basename,
                                          group == "metadata" ? "segments0"
                                                              : "segments1");
-        segment->file = new Tarfile(segment->rf, segment->name);
+        segment->file = new Tarfile(segment->name);
 
         segments[group] = segment;
     } else {
@@ -304,7 +301,7 @@ ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
 
     // If this segment meets or exceeds the size target, close it so that
     // future objects will go into a new segment.
-    if (segment->file->size_estimate() >= SEGMENT_SIZE)
+    if (size_estimate(segment) >= SEGMENT_SIZE)
         close_segment(group);
 
     return ref;
@@ -314,6 +311,7 @@ void TarSegmentStore::sync()
 {
     while (!segments.empty())
         close_segment(segments.begin()->first);
+    finish_segments(true);
 }
 
 void TarSegmentStore::dump_stats()
@@ -330,27 +328,63 @@ void TarSegmentStore::close_segment(const string &group)
 {
     struct segment_info *segment = segments[group];
 
+    // Make room in the staging directory for the compressed segment before
+    // it is written.  Space reserved for segments still being compressed is
+    // only given back once they are sent, so if there is not enough room,
+    // send those first.
+    size_t estimate = size_estimate(segment);
+    if (!remote->can_reserve(estimate))
+        finish_segments(true);
+    segment->rf->reserve(estimate);
+
+    segment->file->finish(&segment->job.data);
     delete segment->file;
+    segment->file = NULL;
 
-    if (db != NULL) {
-        struct stat stat_buf;
-        int disk_size = 0;
-        if (stat(segment->rf->get_local_path().c_str(), &stat_buf) == 0) {
-            disk_size = stat_buf.st_size;
-            group_sizes[segment->group].second += disk_size;
-        }
+    segment->job.fd = segment->rf->get_fd();
+    segment->job.codec = segment_codec;
+    segment->job.filter = filter_program;
+    compressor->submit(&segment->job);
+    compressing.push_back(segment);
 
-        string checksum
-            = Hash::hash_file(segment->rf->get_local_path().c_str());
+    segments.erase(segments.find(group));
 
-        db->SetSegmentMetadata(segment->name, segment->rf->get_remote_path(),
-                               checksum, group, segment->data_size, disk_size);
-    }
+    finish_segments(false);
+}
 
-    segment->rf->send();
+void TarSegmentStore::finish_segments(bool wait)
+{
+    // Segments are finished strictly in the order they were closed, so that
+    // they are sent to the remote store in a deterministic order.
+    size_t max_outstanding = compressor->get_num_threads()
+                             + MAX_QUEUED_SEGMENTS;
+    while (!compressing.empty()) {
+        struct segment_info *segment = compressing.front();
+        if (wait || compressing.size() > max_outstanding)
+            compressor->wait(&segment->job);
+        else if (!compressor->is_done(&segment->job))
+            break;
+        compressing.pop_front();
+
+        int64_t tar_size = segment->job.data.size();
+        string().swap(segment->job.data);
+
+        // The size and checksum of the file were computed as it was written.
+        int64_t disk_size = segment->job.output_size;
+        group_sizes[segment->group].second += disk_size;
+        compression_stats[segment->group].first += tar_size;
+        compression_stats[segment->group].second += disk_size;
+
+        if (db != NULL) {
+            db->SetSegmentMetadata(segment->name,
+                                   segment->rf->get_remote_path(),
+                                   segment->job.checksum, segment->group,
+                                   segment->data_size, disk_size);
+        }
 
-    segments.erase(segments.find(group));
-    delete segment;
+        segment->rf->send();
+        delete segment;
+    }
 }
 
 string TarSegmentStore::object_reference_to_segment(const string &object)
@@ -33,6 +33,7 @@
 #include <iostream>
 #include <sstream>
 
+#include "compress.h"
 #include "cumulus.h"
 #include "localdb.h"
 #include "remote.h"
@@ -107,23 +108,25 @@ private:
 
 /* A simple wrapper around a single TAR file to represent a segment.  Objects
  * may only be written out all at once, since the tar header must be written
- * first; incremental writing is not supported. */
+ * first; incremental writing is not supported.  The TAR file is built up in
+ * memory, uncompressed; finish() returns the completed contents, which are
+ * compressed separately. */
 class Tarfile {
 public:
-    Tarfile(RemoteFile *file, const std::string &segment);
-    ~Tarfile();
+    Tarfile(const std::string &segment);
 
     void write_object(int id, const char *data, size_t len);
 
-    // Return an estimate of the size of the file.
-    size_t size_estimate();
+    // Size of the uncompressed TAR data written so far.
+    size_t size() const { return data.size(); }
+
+    // Add the end-of-archive marker and move the TAR file contents into
+    // *contents.  No more objects may be written afterwards.
+    void finish(std::string *contents);
 
 private:
-    size_t size;
     std::string segment_name;
-
-    RemoteFile *file;
-    scoped_ptr<FileFilter> filter;
+    std::string data;
 
     // Write data to the tar file
     void tar_write(const char *data, size_t size);
@@ -131,11 +134,13 @@ private:
 
 class TarSegmentStore {
 public:
-    // New segments will be stored in the given directory.
+    // New segments will be stored in the given directory.  Finished
+    // segments are compressed by compression_threads worker threads (or
+    // synchronously, if zero).
     TarSegmentStore(RemoteStore *remote,
-                    LocalDb *db = NULL)
-        { this->remote = remote; this->db = db; }
-    ~TarSegmentStore() { sync(); }
+                    LocalDb *db = NULL,
+                    int compression_threads = 0);
+    ~TarSegmentStore();
 
     // Writes an object to segment in the store, and returns the name
     // (segment/object) to refer to it.  The optional parameter group can be
@@ -161,15 +166,35 @@ private:
         int data_size;              // Combined size of objects written
         std::string basename;       // Name of segment without directory
         RemoteFile *rf;
+        CompressionJob job;         // Used once the segment is closed
     };
 
     RemoteStore *remote;
     std::map<std::string, struct segment_info *> segments;
     LocalDb *db;
 
-    // Ensure that all segments in the given group have been fully written.
+    // Closed segments which are being compressed, in the order closed.
+    scoped_ptr<CompressionPool> compressor;
+    std::list<struct segment_info *> compressing;
+
+    // Uncompressed and compressed sizes of segments finished so far, by
+    // group, used to predict how large an open segment will be once it is
+    // compressed.
+    std::map<std::string, std::pair<int64_t, int64_t> > compression_stats;
+
+    // Estimate of the final size of an open segment.
+    size_t size_estimate(const struct segment_info *segment);
+
+    // Close the open segment in the given group, and queue it to be
+    // compressed.
     void close_segment(const std::string &group);
 
+    // Complete the writing of segments which have been compressed: record
+    // them in the database and send them to the remote store.  If wait is
+    // true, wait until all segments are done; otherwise, wait only as needed
+    // to bound the number of segments outstanding.
+    void finish_segments(bool wait);
+
     // Parse an object reference string and return just the segment name
     // portion.
     std::string object_reference_to_segment(const std::string &object);
@@ -229,4 +254,8 @@ extern const char *filter_program;
  * included; this adds to it) */
 extern const char *filter_extension;
 
+/* Name of the Codec used to compress segments in-process.  If empty,
+ * filter_program is run instead. */
+extern std::string segment_codec;
+
 #endif // _LBS_STORE_H
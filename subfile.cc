@@ -26,12 +26,16 @@
 #include <assert.h>
 #include <arpa/inet.h>
 
+#include <algorithm>
+
+#include "chunker.h"
 #include "hash.h"
 #include "subfile.h"
-#include "third_party/chunk.h"
 
+using std::copy;
 using std::list;
 using std::map;
+using std::min;
 using std::set;
 using std::string;
 using std::vector;
@@ -43,8 +47,10 @@ Subfile::Subfile(LocalDb *localdb)
 {
     Hash *hasher = Hash::New();
     hasher->digest();
-    algorithm_name = chunk_algorithm_name() + "/" + hasher->name();
+    Chunker *chunker = Chunker::New();
+    algorithm_name = chunker->name() + "/" + hasher->name();
     hash_size = hasher->digest_size();
+    delete chunker;
     delete hasher;
 }
 
@@ -145,40 +151,91 @@ void Subfile::ensure_signatures_loaded()
 
 void Subfile::analyze_new_block(const char *buf, size_t len)
 {
-    analyzed_buf = buf;
-    analyzed_len = len;
-    int max_chunks = chunk_compute_max_num_breaks(len);
+    vector<chunk_info> chunks;
+    string checksum;
+    compute_chunks(buf, len, &chunks, &checksum);
+    set_new_block(buf, len, chunks, checksum);
+}
 
-    free_analysis();
+/* Data is processed in pieces small enough to stay in cache while the chunker
+ * and each of the hashes run over it. */
+static const size_t ANALYSIS_PIECE_SIZE = 32768;
 
-    size_t *breakpoints = new size_t[max_chunks];
-    int num_breakpoints = chunk_compute_breaks(buf, len, breakpoints);
+void Subfile::compute_chunks(const char *buf, size_t len,
+                             vector<chunk_info> *chunks,
+                             string *checksum, Hash *file_hash)
+{
+    Chunker *chunker = Chunker::New();
+    Hash *block_hash = checksum != NULL ? Hash::New() : NULL;
+    Hash *chunk_hash = Hash::New();
+
+    chunks->clear();
+
+    vector<size_t> breakpoints;
+    size_t chunk_start = 0;
+    for (size_t pos = 0; pos < len; pos += ANALYSIS_PIECE_SIZE) {
+        size_t piece_len = min(ANALYSIS_PIECE_SIZE, len - pos);
+        const char *piece = &buf[pos];
+
+        breakpoints.clear();
+        chunker->update(piece, piece_len, &breakpoints);
+        if (pos + piece_len == len)
+            chunker->finish(&breakpoints);
+
+        if (file_hash != NULL)
+            file_hash->update(piece, piece_len);
+        if (block_hash != NULL)
+            block_hash->update(piece, piece_len);
+
+        // Hash the data up to each chunk boundary in this piece, then the
+        // start of the chunk continuing into the next.
+        size_t hashed = pos;
+        for (size_t i = 0; i < breakpoints.size(); i++) {
+            size_t chunk_end = breakpoints[i] + 1;
+            chunk_hash->update(&buf[hashed], chunk_end - hashed);
+
+            chunk_info info;
+            info.offset = chunk_start;
+            info.len = chunk_end - chunk_start;
+            info.hash = string(
+                reinterpret_cast<const char *>(chunk_hash->digest()),
+                chunk_hash->digest_size());
+            chunks->push_back(info);
+
+            delete chunk_hash;
+            chunk_hash = Hash::New();
+            chunk_start = hashed = chunk_end;
+        }
+        if (hashed < pos + piece_len)
+            chunk_hash->update(&buf[hashed], pos + piece_len - hashed);
+    }
 
-    if (num_breakpoints == 0) {
-        delete[] breakpoints;
-        return;
+    if (block_hash != NULL) {
+        *checksum = block_hash->digest_str();
+        delete block_hash;
     }
+    delete chunk_hash;
+    delete chunker;
+}
 
-    new_block_summary.num_chunks = num_breakpoints;
-    new_block_summary.chunks = new chunk_info[num_breakpoints];
+void Subfile::set_new_block(const char *buf, size_t len,
+                            const vector<chunk_info> &chunks,
+                            const string &checksum)
+{
+    analyzed_buf = buf;
+    analyzed_len = len;
+    analyzed_checksum = checksum;
 
-    int block_start = 0;
-    for (int i = 0; i < num_breakpoints; i++) {
-        new_block_summary.chunks[i].offset = block_start;
-        new_block_summary.chunks[i].len = breakpoints[i] - block_start + 1;
-        block_start = breakpoints[i] + 1;
+    free_analysis();
 
-        Hash *hasher = Hash::New();
-        hasher->update(&buf[new_block_summary.chunks[i].offset],
-                       new_block_summary.chunks[i].len);
-        new_block_summary.chunks[i].hash
-            = string(reinterpret_cast<const char *>(hasher->digest()),
-                     hasher->digest_size());
-        delete hasher;
-    }
+    if (chunks.empty())
+        return;
+
+    new_block_summary.num_chunks = chunks.size();
+    new_block_summary.chunks = new chunk_info[chunks.size()];
+    copy(chunks.begin(), chunks.end(), new_block_summary.chunks);
 
     new_block_summary_valid = true;
-    delete[] breakpoints;
 }
 
 void Subfile::store_block_signatures(ObjectReference ref, block_summary summary)
@@ -267,7 +324,7 @@ list<ObjectReference> Subfile::create_incremental(TarSegmentStore *tss,
     // new object, and the new_block_summary used to save chunk signatures.
     if (!matched_old) {
         o->set_age(block_age);
-        o->set_data(analyzed_buf, analyzed_len, NULL);
+        o->set_data(analyzed_buf, analyzed_len, analyzed_checksum.c_str());
         o->write(tss);
         ObjectReference ref = o->get_ref();
         store_analyzed_signatures(ref);
@@ -295,7 +352,7 @@ list<ObjectReference> Subfile::create_incremental(TarSegmentStore *tss,
         delete hasher;
 
         o->set_group("data");
-        o->set_data(literal_buf, new_data, NULL);
+        o->set_data(literal_buf, new_data, block_csum.c_str());
         o->write(tss);
         ObjectReference ref = o->get_ref();
         for (i = items.begin(); i != items.end(); ++i) {
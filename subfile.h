@@ -30,10 +30,10 @@
 #include <string>
 #include <vector>
 
+#include "hash.h"
 #include "localdb.h"
 #include "ref.h"
 #include "store.h"
-#include "third_party/chunk.h"
 
 class Subfile {
 public:
@@ -44,12 +44,34 @@ public:
     // in the old file.
     void load_old_blocks(const std::list<ObjectReference> &blocks);
 
+    struct chunk_info {
+        int offset, len;
+        std::string hash;
+    };
+
     // Break a new block of data into small chunks, and compute checksums of
     // the chunks.  After doing so, a delta can be computed, or the signatures
     // can be written out to the database.  The caller must not modify the
     // buffer until all operations referring to it are finished.
     void analyze_new_block(const char *buf, size_t len);
 
+    // The two halves of analyze_new_block.  compute_chunks depends on no
+    // Subfile or database state, so it may be run on a separate thread ahead
+    // of time; the result is then supplied with set_new_block.
+    //
+    // compute_chunks can also compute the checksum of the whole block (if
+    // checksum is not NULL) and pass the data to file_hash (if not NULL).
+    // The data is split into chunks and run through all the hashes in a
+    // single pass, a piece at a time, rather than being read from memory
+    // once for each.
+    static void compute_chunks(const char *buf, size_t len,
+                               std::vector<chunk_info> *chunks,
+                               std::string *checksum = NULL,
+                               Hash *file_hash = NULL);
+    void set_new_block(const char *buf, size_t len,
+                       const std::vector<chunk_info> &chunks,
+                       const std::string &checksum);
+
     // Store the signatures for the most recently-analyzed block in the local
     // database (linked to the specified object), if the block is sufficiently
     // large.  If signatures already exist, they will be overwritten.
@@ -65,11 +87,6 @@ private:
     std::string algorithm_name;
     size_t hash_size;
 
-    struct chunk_info {
-        int offset, len;
-        std::string hash;
-    };
-
     struct block_summary {
         ObjectReference ref;
         int num_chunks;
@@ -87,6 +104,7 @@ private:
 
     const char *analyzed_buf;
     size_t analyzed_len;
+    std::string analyzed_checksum;
 
     void ensure_signatures_loaded();
     void index_chunks(ObjectReference ref);
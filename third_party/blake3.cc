@@ -0,0 +1,510 @@
+/* BLAKE3, as specified in https://github.com/BLAKE3-team/BLAKE3-specs
+ * part of Cumulus: Efficient Filesystem Backup to the Cloud
+ *
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of Cumulus contributors.
+ *
+ * The structure follows the BLAKE3 reference implementation (by Jack
+ * O'Connor, Jean-Philippe Aumasson, Samuel Neves, and Zooko Wilcox-O'Hearn,
+ * released into the public domain), with an AVX2 implementation which
+ * compresses eight chunks at once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Only the default hashing mode, with 32-byte output, is implemented.
+ *
+ * Input is split into 1 KB chunks, each compressed 64 bytes at a time into a
+ * chaining value; chaining values are then combined pairwise in a binary
+ * tree.  Since the chunks are independent, several can be compressed in
+ * parallel in the lanes of SIMD registers, which is where BLAKE3 gains most
+ * of its speed over SHA-2. */
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "../hash.h"
+
+#define BLAKE3_OUT_LEN          32
+#define BLAKE3_BLOCK_LEN        64
+#define BLAKE3_CHUNK_LEN        1024
+#define BLAKE3_MAX_DEPTH        54
+
+enum blake3_flags {
+    CHUNK_START = 1 << 0,
+    CHUNK_END = 1 << 1,
+    PARENT = 1 << 2,
+    ROOT = 1 << 3,
+};
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* The message word permutation, applied before each round after the first,
+ * expanded into the word order used by each of the seven rounds. */
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return le32toh(x);
+}
+
+static inline void store32(uint8_t *p, uint32_t x)
+{
+    x = htole32(x);
+    memcpy(p, &x, 4);
+}
+
+static inline uint32_t rotr32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline void g(uint32_t *v, int a, int b, int c, int d,
+                     uint32_t x, uint32_t y)
+{
+    v[a] = v[a] + v[b] + x;
+    v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 7);
+}
+
+/* The compression function, returning the first 8 words of its output, which
+ * is all that is needed for chaining values and for 32 bytes of root
+ * output. */
+static void compress(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                     uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16], v[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = load32(&block[4 * i]);
+
+    for (int i = 0; i < 8; i++)
+        v[i] = cv[i];
+    v[8] = IV[0];
+    v[9] = IV[1];
+    v[10] = IV[2];
+    v[11] = IV[3];
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *s = MSG_SCHEDULE[r];
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; i++)
+        cv[i] = v[i] ^ v[i + 8];
+}
+
+/* Compute the chaining values of num_chunks complete chunks, stored
+ * contiguously in input, with chunk counters starting at counter.  The
+ * portable version compresses one block at a time; the AVX2 version (used
+ * when the processor supports it) works on eight chunks at once. */
+static void hash_chunks_portable(const uint8_t *input, size_t num_chunks,
+                                 uint64_t counter, uint32_t (*out)[8])
+{
+    for (size_t c = 0; c < num_chunks; c++) {
+        memcpy(out[c], IV, sizeof(IV));
+        for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+            uint8_t flags = 0;
+            if (b == 0)
+                flags |= CHUNK_START;
+            if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+                flags |= CHUNK_END;
+            compress(out[c], input + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN,
+                     counter + c, flags);
+        }
+        input += BLAKE3_CHUNK_LEN;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i rot16(__m256i x)
+{
+    const __m256i mask = _mm256_set_epi8(
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    return _mm256_shuffle_epi8(x, mask);
+}
+
+AVX2_TARGET static inline __m256i rot8(__m256i x)
+{
+    const __m256i mask = _mm256_set_epi8(
+        12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+        12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+    return _mm256_shuffle_epi8(x, mask);
+}
+
+AVX2_TARGET static inline __m256i rot12(__m256i x)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20));
+}
+
+AVX2_TARGET static inline __m256i rot7(__m256i x)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25));
+}
+
+AVX2_TARGET static inline void g8(__m256i *v, int a, int b, int c, int d,
+                                  __m256i x, __m256i y)
+{
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+    v[d] = rot16(_mm256_xor_si256(v[d], v[a]));
+    v[c] = _mm256_add_epi32(v[c], v[d]);
+    v[b] = rot12(_mm256_xor_si256(v[b], v[c]));
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+    v[d] = rot8(_mm256_xor_si256(v[d], v[a]));
+    v[c] = _mm256_add_epi32(v[c], v[d]);
+    v[b] = rot7(_mm256_xor_si256(v[b], v[c]));
+}
+
+/* Transpose an 8x8 matrix of 32-bit words held in eight vectors. */
+AVX2_TARGET static inline void transpose8(__m256i *x)
+{
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(x[i], x[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(x[i], x[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        x[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        x[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+AVX2_TARGET
+static void hash8_avx2(const uint8_t *input, uint64_t counter,
+                       uint32_t (*out)[8])
+{
+    __m256i h[8], v[16], m[16];
+
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi32(IV[i]);
+
+    uint32_t lo[8], hi[8];
+    for (int i = 0; i < 8; i++) {
+        lo[i] = (uint32_t)(counter + i);
+        hi[i] = (uint32_t)((counter + i) >> 32);
+    }
+    const __m256i counter_lo = _mm256_loadu_si256((const __m256i *)lo);
+    const __m256i counter_hi = _mm256_loadu_si256((const __m256i *)hi);
+
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+        // Load the block from each chunk and transpose, so that m[i] holds
+        // message word i for all eight chunks.  This assumes a little-endian
+        // processor, which x86 is.
+        const uint8_t *p = input + b * BLAKE3_BLOCK_LEN;
+        for (int i = 0; i < 8; i++) {
+            m[i] = _mm256_loadu_si256(
+                (const __m256i *)(p + i * BLAKE3_CHUNK_LEN));
+            m[i + 8] = _mm256_loadu_si256(
+                (const __m256i *)(p + i * BLAKE3_CHUNK_LEN + 32));
+        }
+        transpose8(m);
+        transpose8(m + 8);
+
+        uint32_t flags = 0;
+        if (b == 0)
+            flags |= CHUNK_START;
+        if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+            flags |= CHUNK_END;
+
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[i + 8] = _mm256_set1_epi32(IV[i]);
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = _mm256_set1_epi32(BLAKE3_BLOCK_LEN);
+        v[15] = _mm256_set1_epi32(flags);
+
+        for (int r = 0; r < 7; r++) {
+            const uint8_t *s = MSG_SCHEDULE[r];
+            g8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+            g8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+            g8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+            g8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+            g8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+            g8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            g8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+            g8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+
+    // h[i] holds word i of each chaining value; transpose back.
+    transpose8(h);
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)out[i], h[i]);
+}
+
+static void hash_chunks_avx2(const uint8_t *input, size_t num_chunks,
+                             uint64_t counter, uint32_t (*out)[8])
+{
+    while (num_chunks >= 8) {
+        hash8_avx2(input, counter, out);
+        input += 8 * BLAKE3_CHUNK_LEN;
+        num_chunks -= 8;
+        counter += 8;
+        out += 8;
+    }
+
+    // A few chunks left over (as for small messages) are still faster to
+    // compress with some lanes idle, working on a copy of the input.
+    if (num_chunks >= 3) {
+        uint8_t padded[8 * BLAKE3_CHUNK_LEN];
+        uint32_t cvs[8][8];
+        memcpy(padded, input, num_chunks * BLAKE3_CHUNK_LEN);
+        memset(padded + num_chunks * BLAKE3_CHUNK_LEN, 0,
+               (8 - num_chunks) * BLAKE3_CHUNK_LEN);
+        hash8_avx2(padded, counter, cvs);
+        memcpy(out, cvs, num_chunks * sizeof(cvs[0]));
+    } else {
+        hash_chunks_portable(input, num_chunks, counter, out);
+    }
+}
+
+static bool avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static void hash_chunks_avx2(const uint8_t *input, size_t num_chunks,
+                             uint64_t counter, uint32_t (*out)[8])
+{
+    hash_chunks_portable(input, num_chunks, counter, out);
+}
+
+static bool avx2_supported()
+{
+    return false;
+}
+
+#endif
+
+static void (*hash_chunks)(const uint8_t *input, size_t num_chunks,
+                           uint64_t counter, uint32_t (*out)[8])
+    = hash_chunks_portable;
+
+/* Number of chunks handed to hash_chunks at once, when enough input is
+ * available. */
+static const size_t CHUNK_BATCH = 16;
+
+class Blake3Hash : public Hash {
+public:
+    Blake3Hash();
+    static Hash *New() { return new Blake3Hash; }
+    virtual void update(const void *data, size_t len);
+    virtual size_t digest_size() const { return BLAKE3_OUT_LEN; }
+    virtual std::string name() const { return "blake3"; }
+
+protected:
+    const uint8_t *finalize();
+
+private:
+    // The chunk in progress: its chaining value so far and any buffered
+    // input not yet compressed.  The final block of a chunk is always kept
+    // buffered, since it is compressed with different flags if it turns out
+    // to be the last block of the input.
+    uint32_t chunk_cv[8];
+    uint64_t chunk_counter;
+    uint8_t buf[BLAKE3_BLOCK_LEN];
+    size_t buf_len;
+    size_t blocks_compressed;
+
+    // Chaining values of completed subtrees, largest first.
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+    size_t cv_stack_len;
+
+    uint8_t digest_buf[BLAKE3_OUT_LEN];
+
+    size_t chunk_len() const {
+        return blocks_compressed * BLAKE3_BLOCK_LEN + buf_len;
+    }
+    void start_chunk(uint64_t counter);
+    void add_chunk_cv(const uint32_t cv[8], uint64_t total_chunks);
+};
+
+Blake3Hash::Blake3Hash()
+    : cv_stack_len(0)
+{
+    start_chunk(0);
+}
+
+void Blake3Hash::start_chunk(uint64_t counter)
+{
+    memcpy(chunk_cv, IV, sizeof(IV));
+    chunk_counter = counter;
+    buf_len = 0;
+    blocks_compressed = 0;
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8],
+                      uint8_t flags, uint32_t out[8])
+{
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    for (int i = 0; i < 8; i++) {
+        store32(&block[4 * i], left[i]);
+        store32(&block[32 + 4 * i], right[i]);
+    }
+    memcpy(out, IV, sizeof(IV));
+    compress(out, block, BLAKE3_BLOCK_LEN, 0, PARENT | flags);
+}
+
+/* Push the chaining value of a completed chunk, first merging it with the
+ * completed subtrees it completes: one for each trailing zero bit in the
+ * total number of chunks so far. */
+void Blake3Hash::add_chunk_cv(const uint32_t cv[8], uint64_t total_chunks)
+{
+    uint32_t new_cv[8];
+    memcpy(new_cv, cv, sizeof(new_cv));
+    while ((total_chunks & 1) == 0) {
+        cv_stack_len--;
+        parent_cv(cv_stack[cv_stack_len], new_cv, 0, new_cv);
+        total_chunks >>= 1;
+    }
+    memcpy(cv_stack[cv_stack_len], new_cv, sizeof(new_cv));
+    cv_stack_len++;
+}
+
+void Blake3Hash::update(const void *data, size_t len)
+{
+    const uint8_t *input = static_cast<const uint8_t *>(data);
+
+    while (len > 0) {
+        // A full chunk is only finished once more input arrives, since the
+        // last chunk is compressed differently.
+        if (chunk_len() == BLAKE3_CHUNK_LEN) {
+            compress(chunk_cv, buf, BLAKE3_BLOCK_LEN, chunk_counter,
+                     CHUNK_END | (blocks_compressed == 0 ? CHUNK_START : 0));
+            add_chunk_cv(chunk_cv, chunk_counter + 1);
+            start_chunk(chunk_counter + 1);
+        }
+
+        // At a chunk boundary with whole chunks of input to spare, compress
+        // a batch of chunks at once.
+        if (chunk_len() == 0 && len > BLAKE3_CHUNK_LEN) {
+            uint32_t cvs[CHUNK_BATCH][8];
+            size_t n = (len - 1) / BLAKE3_CHUNK_LEN;
+            if (n > CHUNK_BATCH)
+                n = CHUNK_BATCH;
+            hash_chunks(input, n, chunk_counter, cvs);
+            for (size_t i = 0; i < n; i++)
+                add_chunk_cv(cvs[i], chunk_counter + i + 1);
+            start_chunk(chunk_counter + n);
+            input += n * BLAKE3_CHUNK_LEN;
+            len -= n * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+
+        // Otherwise fill the block buffer, compressing it first if it is
+        // full and this chunk has more data to come.
+        if (buf_len == BLAKE3_BLOCK_LEN) {
+            compress(chunk_cv, buf, BLAKE3_BLOCK_LEN, chunk_counter,
+                     blocks_compressed == 0 ? CHUNK_START : 0);
+            blocks_compressed++;
+            buf_len = 0;
+        }
+        size_t take = BLAKE3_BLOCK_LEN - buf_len;
+        if (take > len)
+            take = len;
+        memcpy(&buf[buf_len], input, take);
+        buf_len += take;
+        input += take;
+        len -= take;
+    }
+}
+
+const uint8_t *Blake3Hash::finalize()
+{
+    // The last block of the last chunk; it is the root node itself unless
+    // there are completed subtrees to merge with.
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    memset(block, 0, sizeof(block));
+    memcpy(block, buf, buf_len);
+    uint8_t flags = CHUNK_END | (blocks_compressed == 0 ? CHUNK_START : 0);
+
+    uint32_t cv[8];
+    memcpy(cv, chunk_cv, sizeof(cv));
+    if (cv_stack_len == 0) {
+        compress(cv, block, buf_len, chunk_counter, flags | ROOT);
+    } else {
+        compress(cv, block, buf_len, chunk_counter, flags);
+        while (cv_stack_len > 1) {
+            cv_stack_len--;
+            parent_cv(cv_stack[cv_stack_len], cv, 0, cv);
+        }
+        parent_cv(cv_stack[0], cv, ROOT, cv);
+    }
+
+    for (int i = 0; i < 8; i++)
+        store32(&digest_buf[4 * i], cv[i]);
+    return digest_buf;
+}
+
+void blake3_register(bool accelerated)
+{
+    if (accelerated && avx2_supported())
+        hash_chunks = hash_chunks_avx2;
+    else
+        hash_chunks = hash_chunks_portable;
+
+    Hash::Register("blake3", Blake3Hash::New);
+}
@@ -280,26 +280,59 @@ int chunk_compute_max_num_breaks(size_t buflen)
     return (buflen / MIN_CHUNK_SIZE) + 1;
 }
 
-int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints)
+struct chunk_state {
+    window w;
+    size_t block_len;           // Bytes in the chunk in progress
+
+    chunk_state() : w(FINGERPRINT_PT), block_len(0) { }
+};
+
+chunk_state *chunk_state_new()
 {
-    size_t start, pos;
-    window w(FINGERPRINT_PT);
+    return new chunk_state;
+}
+
+void chunk_state_free(chunk_state *state)
+{
+    delete state;
+}
+
+void chunk_state_reset(chunk_state *state)
+{
+    state->w.reset();
+    state->block_len = 0;
+}
 
+size_t chunk_state_pending(const chunk_state *state)
+{
+    return state->block_len;
+}
+
+int chunk_compute_breaks_incremental(chunk_state *state,
+                                     const char *buf, size_t len,
+                                     size_t *breakpoints)
+{
     int i = 0;
-    start = 0;
-    for (pos = 0; pos < len; pos++) {
-        uint64_t sig = w.slide8(buf[pos]);
-        size_t block_len = pos - start + 1;
+    for (size_t pos = 0; pos < len; pos++) {
+        uint64_t sig = state->w.slide8(buf[pos]);
+        size_t block_len = ++state->block_len;
         if ((sig % TARGET_CHUNK_SIZE == BREAKMARK_VALUE
              && block_len >= MIN_CHUNK_SIZE) || block_len >= MAX_CHUNK_SIZE) {
             breakpoints[i] = pos;
-            start = pos + 1;
             i++;
-            w.reset();
+            chunk_state_reset(state);
         }
     }
 
-    if (start < len) {
+    return i;
+}
+
+int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints)
+{
+    chunk_state state;
+    int i = chunk_compute_breaks_incremental(&state, buf, len, breakpoints);
+
+    if (state.block_len > 0) {
         breakpoints[i] = len - 1;
         i++;
     }
@@ -37,4 +37,20 @@ int chunk_compute_max_num_breaks(size_t buflen);
 int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints);
 std::string chunk_algorithm_name();
 
+/* Incremental interface, for data which arrives in pieces.  A chunk_state
+ * holds the fingerprint window and the length of the chunk in progress.  Each
+ * call to chunk_compute_breaks_incremental continues where the last left off,
+ * storing the offsets (within buf) of the ends of any chunks found and
+ * returning their number; at most chunk_compute_max_num_breaks(len).  Once
+ * all data has been supplied, the final chunk ends at the last byte if
+ * chunk_state_pending is non-zero. */
+struct chunk_state;
+chunk_state *chunk_state_new();
+void chunk_state_free(chunk_state *state);
+void chunk_state_reset(chunk_state *state);
+size_t chunk_state_pending(const chunk_state *state);
+int chunk_compute_breaks_incremental(chunk_state *state,
+                                     const char *buf, size_t len,
+                                     size_t *breakpoints);
+
 #endif // _LBS_CHUNK_H
@@ -32,6 +32,7 @@
 
 #include "../hash.h"
 #include "sha1.h"
+#include "sha_ni.h"
 
 #include <stddef.h>
 #include <stdio.h>
@@ -55,6 +56,10 @@ using std::string;
    64-byte boundary.  (RFC 1321, 3.1: Step 1)  */
 static const unsigned char fillbuf[64] = { 0x80, 0 /* , 0, 0, ...  */ };
 
+/* Whether to use the SHA extensions of the processor for the block function;
+   set by sha1_register.  */
+static bool use_sha_ni = false;
+
 
 /*
   Takes a pointer to a 160 bit block of data (five 32 bit ints) and
@@ -226,6 +231,18 @@ sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
   if (ctx->total[0] < len)
     ++ctx->total[1];
 
+  if (use_sha_ni)
+    {
+      md5_uint32 state[5] = { a, b, c, d, e };
+      sha1_ni_blocks (state, (const uint8_t *) buffer, len / 64);
+      ctx->A = state[0];
+      ctx->B = state[1];
+      ctx->C = state[2];
+      ctx->D = state[3];
+      ctx->E = state[4];
+      return;
+    }
+
 #define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 
 #define M(I) ( tm =   x[I&0x0f] ^ x[(I-14)&0x0f] \
@@ -429,7 +446,8 @@ const uint8_t *SHA1Hash::finalize()
     return (const uint8_t *)resbuf;
 }
 
-void sha1_register()
+void sha1_register(bool accelerated)
 {
+    use_sha_ni = accelerated && sha_ni_supported();
     Hash::Register("sha1", SHA1Hash::New);
 }
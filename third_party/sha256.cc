@@ -35,6 +35,7 @@
 #include <string.h>
 
 #include "../hash.h"
+#include "sha_ni.h"
 
 /* Adaptation code for a non-kernel build environment. */
 typedef uint8_t u8;
@@ -276,6 +277,18 @@ static void sha256_transform(u32 *state, const u8 *input)
 }
 
 
+/* The block function, which processes any number of complete blocks; either
+ * the portable one below or one using the SHA extensions of the processor.
+ * Selected by sha256_register. */
+static void sha256_generic_blocks(u32 *state, const u8 *data, size_t blocks)
+{
+	for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE)
+		sha256_transform(state, data);
+}
+
+static void (*sha256_blocks)(u32 *state, const u8 *data, size_t blocks)
+	= sha256_generic_blocks;
+
 static int sha224_init(struct sha256_state *sctx)
 {
 	sctx->state[0] = SHA224_H0;
@@ -321,14 +334,14 @@ static int sha256_update(struct sha256_state *sctx, const u8 *data,
 		if (partial) {
 			done = -partial;
 			memcpy(sctx->buf + partial, data, done + 64);
-			src = sctx->buf;
+			sha256_blocks(sctx->state, sctx->buf, 1);
+			done += 64;
 		}
 
-		do {
-			sha256_transform(sctx->state, src);
-			done += 64;
-			src = data + done;
-		} while (done + 63 < len);
+		/* All remaining complete blocks are handled in one call. */
+		sha256_blocks(sctx->state, data + done, (len - done) / 64);
+		done += (len - done) & ~63;
+		src = data + done;
 
 		partial = 0;
 	}
@@ -438,8 +451,13 @@ const uint8_t *SHA224Hash::finalize()
     return reinterpret_cast<uint8_t *>(digest_buf);
 }
 
-void sha256_register()
+void sha256_register(bool accelerated)
 {
+    if (accelerated && sha_ni_supported())
+        sha256_blocks = sha256_ni_blocks;
+    else
+        sha256_blocks = sha256_generic_blocks;
+
     Hash::Register("sha224", SHA224Hash::New);
     Hash::Register("sha256", SHA256Hash::New);
 }
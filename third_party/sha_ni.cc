@@ -0,0 +1,206 @@
+/* Block functions for SHA-1 and SHA-256 using the x86 SHA extensions.
+ * part of Cumulus: Efficient Filesystem Backup to the Cloud
+ *
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of Cumulus contributors.
+ *
+ * The instruction sequences follow Intel's description of the extensions
+ * ("Intel SHA Extensions", Gulley et al., 2013).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The functions here are compiled for the SHA extensions using function
+ * attributes, so that the rest of the program (and this file) can still be
+ * built for, and run on, processors without them.  Callers check
+ * sha_ni_supported() at run time before using them. */
+
+#include <stdlib.h>
+
+#include "sha_ni.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+bool sha_ni_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+        return false;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;      // SHA
+}
+
+/* SHA-1.  Each group of four rounds uses one vector of message words; the
+ * round function (the immediate operand to sha1rnds4) changes every five
+ * groups.  The message vector for group i + 4 is computed from those for
+ * groups i to i + 3 once group i is done with its own. */
+#define SHA1_MSG(i)                                                     \
+    msg[(i) & 3] = _mm_sha1msg2_epu32(                                  \
+        _mm_xor_si128(_mm_sha1msg1_epu32(msg[(i) & 3], msg[((i) + 1) & 3]), \
+                      msg[((i) + 2) & 3]),                              \
+        msg[((i) + 3) & 3])
+
+#define SHA1_ROUNDS(i, f)                                               \
+    do {                                                                \
+        e1 = _mm_sha1nexte_epu32(e0, msg[(i) & 3]);                     \
+        e0 = abcd;                                                      \
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, f);                        \
+        if ((i) < 16)                                                   \
+            SHA1_MSG(i);                                                \
+    } while (0)
+
+SHA_NI_TARGET
+void sha1_ni_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_loadu_si128((const __m128i *)state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1;
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abcd_save = abcd, e_save = e0;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+
+        // The first group adds E directly; the rest use sha1nexte to
+        // compute it from the previous value of A.
+        e1 = _mm_add_epi32(e0, msg[0]);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        SHA1_MSG(0);
+
+        SHA1_ROUNDS(1, 0);  SHA1_ROUNDS(2, 0);  SHA1_ROUNDS(3, 0);
+        SHA1_ROUNDS(4, 0);  SHA1_ROUNDS(5, 1);  SHA1_ROUNDS(6, 1);
+        SHA1_ROUNDS(7, 1);  SHA1_ROUNDS(8, 1);  SHA1_ROUNDS(9, 1);
+        SHA1_ROUNDS(10, 2); SHA1_ROUNDS(11, 2); SHA1_ROUNDS(12, 2);
+        SHA1_ROUNDS(13, 2); SHA1_ROUNDS(14, 2); SHA1_ROUNDS(15, 3);
+        SHA1_ROUNDS(16, 3); SHA1_ROUNDS(17, 3); SHA1_ROUNDS(18, 3);
+        SHA1_ROUNDS(19, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* SHA-256.  The state is kept as the vectors ABEF and CDGH, as sha256rnds2
+ * expects; each group of four rounds is two sha256rnds2 instructions.  The
+ * message schedule is computed as for SHA-1 above. */
+SHA_NI_TARGET
+void sha256_ni_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i cdgh = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);                 // CDAB
+    cdgh = _mm_shuffle_epi32(cdgh, 0x1b);               // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);       // ABEF
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);            // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef_save = abef, cdgh_save = cdgh;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+
+        for (int i = 0; i < 16; i++) {
+            __m128i wk = _mm_add_epi32(
+                msg[i & 3], _mm_load_si128((const __m128i *)&sha256_k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                         _mm_shuffle_epi32(wk, 0x0e));
+
+            if (i < 12) {
+                __m128i w = _mm_sha256msg1_epu32(msg[i & 3],
+                                                 msg[(i + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(i + 3) & 3],
+                                                     msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(w, msg[(i + 3) & 3]);
+            }
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);                // FEBA
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);               // DCHG
+    abef = _mm_blend_epi16(tmp, cdgh, 0xf0);            // DCBA
+    cdgh = _mm_alignr_epi8(cdgh, tmp, 8);               // HGFE
+    _mm_storeu_si128((__m128i *)&state[0], abef);
+    _mm_storeu_si128((__m128i *)&state[4], cdgh);
+}
+
+#else
+
+bool sha_ni_supported()
+{
+    return false;
+}
+
+void sha1_ni_blocks(uint32_t *, const uint8_t *, size_t)
+{
+    abort();
+}
+
+void sha256_ni_blocks(uint32_t *, const uint8_t *, size_t)
+{
+    abort();
+}
+
+#endif
@@ -0,0 +1,39 @@
+/* Block functions for SHA-1 and SHA-256 using the x86 SHA extensions.
+ * part of Cumulus: Efficient Filesystem Backup to the Cloud
+ *
+ * Copyright (C) 2013 The Cumulus Developers
+ * See the AUTHORS file for a list of Cumulus contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _CUMULUS_SHA_NI_H
+#define _CUMULUS_SHA_NI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returns true if the processor supports the SHA extensions (and the SSE4.1
+ * instructions the functions below also use).  Always false on other
+ * architectures; the functions below must only be called if this returns
+ * true. */
+bool sha_ni_supported();
+
+/* Update the hash state (as native-endian words, in the usual order A..E or
+ * A..H) with the given number of complete 64-byte blocks of data. */
+void sha1_ni_blocks(uint32_t state[5], const uint8_t *data, size_t blocks);
+void sha256_ni_blocks(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+#endif // _CUMULUS_SHA_NI_H
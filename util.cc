@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -142,6 +143,15 @@ void cloexec(int fd)
     fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
 }
 
+/* Current time in seconds, from a clock which is not affected by changes to
+ * the system time; for measuring intervals only. */
+double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /* Report a fatal error and exit. */
 void fatal(string msg)
 {
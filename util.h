@@ -36,6 +36,7 @@ std::string encode_int(long long n, int base=10);
 
 long long parse_int(const std::string &s);
 void cloexec(int fd);
+double monotonic_time();
 
 void fatal(std::string msg) __attribute__((noreturn));
 